@@ -1,11 +1,24 @@
 #include <cassert>
 #include <algorithm>  
+#include <ctime>
 #include <vector>
 
 #include "EStore.h"
+#include "MutationLog.h"
 
 using namespace std;
 
+// Unlocks per thread between checks for a due contention sample.
+#define HOT_SAMPLE_UNLOCKS 256
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 
 Item::
 Item() : valid(false)
@@ -16,35 +29,590 @@ Item::
 { }
 
 
+LockStripes::
+LockStripes(int count)
+    : stripes(new Stripe[count]), numStripes(count)
+{
+    assert(count > 0);
+    for (int i = 0; i < numStripes; ++i) {
+        smutex_init(&stripes[i].mtx);
+        scond_init(&stripes[i].cv);
+    }
+}
+
+LockStripes::
+~LockStripes()
+{
+    for (int i = 0; i < numStripes; ++i) {
+        scond_destroy(&stripes[i].cv);
+        smutex_destroy(&stripes[i].mtx);
+    }
+    delete[] stripes;
+}
+
+
 EStore::
 EStore(bool enableFineMode)
-    : fineMode(enableFineMode)
+    : owned(new OwnedSync), stripes(nullptr), stripeBase(0),
+      shippingCost(3), storeDiscount(0), nextWatchId(0), mutationLog(nullptr),
+      hotSlots(nullptr), nextSample(0), fineMode(enableFineMode)
 {
-    smutex_init(&mtx);
-    for (int i = 0; i < INVENTORY_SIZE; ++i) scond_init(&item_cv[i]);
+    for (int i = 0; i < INVENTORY_SIZE; ++i) watches[i] = nullptr;
+    for (int i = 0; i < INVENTORY_SIZE; ++i) {
+        hotSlot[i].store(nullptr);
+        wantSlot[i].store(0);
+        contended[i].store(0);
+        lastContended[i] = 0;
+    }
+    for (int i = 0; i < HOT_SLOTS; ++i) slotOwner[i] = -1;
+    smutex_init(&sample_mtx);
+    smutex_init(storeLock());
+    for (int i = 0; i < INVENTORY_SIZE; ++i) scond_init(itemCond(i));
 
     // fine-grained
     for (int i = 0; i < INVENTORY_SIZE; ++i) {
-        smutex_init(&item_mtx[i]);
-        scond_init(&item_cv_fine[i]);
+        smutex_init(homeLock(i));
+        scond_init(homeCond(i));
     }
     smutex_init(&global_mtx);
 }
 
+EStore::
+EStore(bool enableFineMode, LockStripes* sharedStripes, int stripeSalt)
+    : owned(nullptr), stripes(sharedStripes), stripeBase(stripeSalt),
+      shippingCost(3), storeDiscount(0), nextWatchId(0), mutationLog(nullptr),
+      hotSlots(nullptr), nextSample(0), fineMode(enableFineMode)
+{
+    assert(stripes != nullptr && stripeBase >= 0);
+    for (int i = 0; i < INVENTORY_SIZE; ++i) watches[i] = nullptr;
+    for (int i = 0; i < INVENTORY_SIZE; ++i) {
+        hotSlot[i].store(nullptr);
+        wantSlot[i].store(0);
+        contended[i].store(0);
+        lastContended[i] = 0;
+    }
+    for (int i = 0; i < HOT_SLOTS; ++i) slotOwner[i] = -1;
+    smutex_init(&sample_mtx);
+    smutex_init(&global_mtx);
+}
+
 EStore::
 ~EStore()
 {
-    for (int i = 0; i < INVENTORY_SIZE; ++i) scond_destroy(&item_cv[i]);
-    smutex_destroy(&mtx);
+    for (int i = 0; i < INVENTORY_SIZE; ++i) delete watches[i];
+    if (owned) {
+        for (int i = 0; i < INVENTORY_SIZE; ++i) scond_destroy(itemCond(i));
+        smutex_destroy(storeLock());
 
-    // fine-grained
-    for (int i = 0; i < INVENTORY_SIZE; ++i) {
-        scond_destroy(&item_cv_fine[i]);
-        smutex_destroy(&item_mtx[i]);
+        // fine-grained
+        for (int i = 0; i < INVENTORY_SIZE; ++i) {
+            scond_destroy(homeCond(i));
+            smutex_destroy(homeLock(i));
+        }
+        delete owned;
+    }
+    if (hotSlots) {
+        for (int i = 0; i < HOT_SLOTS; ++i) {
+            scond_destroy(&hotSlots[i].cv);
+            smutex_destroy(&hotSlots[i].mtx);
+        }
+        delete[] hotSlots;
     }
+    smutex_destroy(&sample_mtx);
     smutex_destroy(&global_mtx);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * storeLock, itemCond, homeLock, homeCond --
+ *
+ *      Map the store and its items to synchronization objects. A
+ *      standalone store uses its own arrays. A hosted store uses the
+ *      shared stripes: the whole store maps to one stripe in coarse
+ *      mode, each item to its own stripe in fine mode. homeLock and
+ *      homeCond are where a fine mode item lives unless it is hot.
+ *
+ * Results:
+ *      The mutex or condition variable to use.
+ *
+ * ------------------------------------------------------------------
+ */
+smutex_t* EStore::
+storeLock()
+{
+    return owned ? &owned->mtx : stripes->lock(stripeBase);
+}
+
+scond_t* EStore::
+itemCond(int item_id)
+{
+    return owned ? &owned->item_cv[item_id] : stripes->cond(stripeBase);
+}
+
+smutex_t* EStore::
+homeLock(int item_id)
+{
+    return owned ? &owned->item_mtx[item_id] : stripes->lock(stripeBase + item_id);
+}
+
+scond_t* EStore::
+homeCond(int item_id)
+{
+    return owned ? &owned->item_cv_fine[item_id] : stripes->cond(stripeBase + item_id);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * itemLock, itemCondFine --
+ *
+ *      Return the fine mode lock and condition variable an item uses
+ *      right now: its hot slot if it has one, else its home. Stable
+ *      only while the item's lock is held.
+ *
+ * Results:
+ *      The mutex or condition variable to use.
+ *
+ * ------------------------------------------------------------------
+ */
+smutex_t* EStore::
+itemLock(int item_id)
+{
+    HotSlot* h = hotSlot[item_id].load(std::memory_order_acquire);
+    return h ? &h->mtx : homeLock(item_id);
+}
+
+scond_t* EStore::
+itemCondFine(int item_id)
+{
+    HotSlot* h = hotSlot[item_id].load(std::memory_order_acquire);
+    return h ? &h->cv : homeCond(item_id);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockCounting --
+ *
+ *      Lock m, counting a contended acquire against item_id if m
+ *      was busy.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockCounting(smutex_t* m, int item_id)
+{
+    if (!smutex_trylock(m)) {
+        contended[item_id].fetch_add(1, std::memory_order_relaxed);
+        smutex_lock(m);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockItem, unlockItem --
+ *
+ *      Lock or unlock an item in fine mode. lockItem retries if the
+ *      item moved to another lock while it waited. unlockItem first
+ *      carries out a move the sampler asked for, and every so often
+ *      runs the sampler.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockItem(int item_id)
+{
+    for (;;) {
+        HotSlot* h = hotSlot[item_id].load(std::memory_order_acquire);
+        smutex_t* m = h ? &h->mtx : homeLock(item_id);
+        lockCounting(m, item_id);
+        if (hotSlot[item_id].load(std::memory_order_acquire) == h) return;
+        smutex_unlock(m);
+    }
+}
+
+void EStore::
+unlockItem(int item_id)
+{
+    smutex_t* m = itemLock(item_id);
+    moveIfWanted_nolock(item_id);
+    smutex_unlock(m);
+
+    static thread_local unsigned unlocks = 0;
+    if (++unlocks % HOT_SAMPLE_UNLOCKS == 0) sampleContention();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * moveIfWanted_nolock --
+ *
+ *      If the sampler wants the item on another lock, point the item
+ *      there. Must be the last change made before releasing the
+ *      item's current lock: new lockers take the new lock from the
+ *      moment of the store, and those queued on the old one retry.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+moveIfWanted_nolock(int item_id)
+{
+    int want = wantSlot[item_id].load(std::memory_order_acquire);
+    HotSlot* target = want ? &hotSlots[want - 1] : nullptr;
+    HotSlot* cur = hotSlot[item_id].load(std::memory_order_relaxed);
+    if (target == cur) return;
+
+    hotSlot[item_id].store(target, std::memory_order_release);
+
+    LockMigration mig;
+    mig.when = now_sec();
+    mig.item_id = item_id;
+    mig.promoted = target != nullptr;
+    smutex_lock(&sample_mtx);
+    mig.contended = lastContended[item_id];
+    migrations.push_back(mig);
+    smutex_unlock(&sample_mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * sampleContention --
+ *
+ *      Once per HOT_SAMPLE_SEC, collect the per-item contention
+ *      counts of the past window. Hot items that cooled down to
+ *      HOT_DEMOTE_MAX or less are sent home. Then the hottest items
+ *      with at least HOT_PROMOTE_MIN contended acquires take the
+ *      free dedicated slots. Moves happen at each item's next
+ *      unlock.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+sampleContention()
+{
+    if (!smutex_trylock(&sample_mtx)) return;
+    double now = now_sec();
+    if (now < nextSample) {
+        smutex_unlock(&sample_mtx);
+        return;
+    }
+    nextSample = now + HOT_SAMPLE_SEC;
+
+    long counts[INVENTORY_SIZE];
+    for (int i = 0; i < INVENTORY_SIZE; ++i) {
+        counts[i] = contended[i].exchange(0, std::memory_order_relaxed);
+    }
+
+    for (int s = 0; s < HOT_SLOTS; ++s) {
+        int o = slotOwner[s];
+        if (o < 0) continue;
+        if (wantSlot[o].load(std::memory_order_relaxed) == 0) {
+            // Demoted earlier; the slot is free once the item has left.
+            if (hotSlot[o].load(std::memory_order_acquire) != &hotSlots[s]) slotOwner[s] = -1;
+        } else if (counts[o] <= HOT_DEMOTE_MAX) {
+            lastContended[o] = counts[o];
+            wantSlot[o].store(0, std::memory_order_release);
+        }
+    }
+
+    for (int s = 0; s < HOT_SLOTS; ++s) {
+        if (slotOwner[s] >= 0) continue;
+        int best = -1;
+        for (int i = 0; i < INVENTORY_SIZE; ++i) {
+            bool home = wantSlot[i].load(std::memory_order_relaxed) == 0
+                        && hotSlot[i].load(std::memory_order_relaxed) == nullptr;
+            if (home && counts[i] >= HOT_PROMOTE_MIN && (best < 0 || counts[i] > counts[best])) {
+                best = i;
+            }
+        }
+        if (best < 0) break;
+        if (!hotSlots) {
+            hotSlots = new HotSlot[HOT_SLOTS];
+            for (int i = 0; i < HOT_SLOTS; ++i) {
+                smutex_init(&hotSlots[i].mtx);
+                scond_init(&hotSlots[i].cv);
+            }
+        }
+        slotOwner[s] = best;
+        lastContended[best] = counts[best];
+        wantSlot[best].store(s + 1, std::memory_order_release);
+    }
+    smutex_unlock(&sample_mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * getLockMigrations --
+ *
+ *      Return every move between home locks and hot slots so far.
+ *
+ * Results:
+ *      The moves, oldest first.
+ *
+ * ------------------------------------------------------------------
+ */
+vector<LockMigration> EStore::
+getLockMigrations()
+{
+    smutex_lock(&sample_mtx);
+    vector<LockMigration> out = migrations;
+    smutex_unlock(&sample_mtx);
+    return out;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * lockWatches, unlockWatches --
+ *
+ *      Take or release the lock guarding an item's watches: the item
+ *      lock in fine mode, the store lock otherwise.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+lockWatches(int item_id)
+{
+    if (fineMode) {
+        lockItem(item_id);
+    } else {
+        smutex_lock(storeLock());
+    }
+}
+
+void EStore::
+unlockWatches(int item_id)
+{
+    if (fineMode) {
+        unlockItem(item_id);
+    } else {
+        smutex_unlock(storeLock());
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * globalPricing --
+ *
+ *      Read the shipping cost and store discount. In fine mode this
+ *      takes global_mtx, which may be nested inside an item lock
+ *      (never the other way around).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+globalPricing(double* ship, double* discount)
+{
+    if (fineMode) smutex_lock(&global_mtx);
+    *ship = shippingCost;
+    *discount = storeDiscount;
+    if (fineMode) smutex_unlock(&global_mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * collectWatches_nolock --
+ *
+ *      Remove the item's watches whose threshold the current cost
+ *      has reached and append them to *fired. Call after any change
+ *      that may lower the cost, with the item's watches locked.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+collectWatches_nolock(int item_id, vector<Watch>* fired)
+{
+    WatchIndex* idx = watches[item_id];
+    const Item& it = inventory[item_id];
+    if (!idx || idx->empty() || !it.valid) return;
+
+    double ship, discount;
+    globalPricing(&ship, &discount);
+    double cost = itemCurrentPrice_nolock(it) * (1.0 - discount) + ship;
+
+    WatchIndex::iterator first = idx->lower_bound(cost);
+    for (WatchIndex::iterator w = first; w != idx->end(); ++w) {
+        fired->push_back(w->second);
+    }
+    idx->erase(first, idx->end());
+}
+
+/*
+ * ------------------------------------------------------------------
+ * dispatchWatches --
+ *
+ *      Run or enqueue the tasks of fired watches. Must be called
+ *      with no store locks held, since callbacks may call back into
+ *      the store.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+dispatchWatches(const vector<Watch>& fired)
+{
+    for (const Watch& w : fired) {
+        if (w.queue) {
+            w.queue->enqueue(w.task);
+        } else {
+            w.task.handler(w.task.arg);
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * watch --
+ *
+ *      Register a one-shot watch that fires once the overall cost
+ *      of the item drops to threshold or below. Firing runs
+ *      task.handler(task.arg) on the thread that lowered the cost,
+ *      or enqueues the task on queue if one is given. If the store
+ *      carries the item and its cost is already at or below the
+ *      threshold, the watch fires right away.
+ *
+ * Results:
+ *      A handle for unwatch. Its id is -1 if item_id is invalid.
+ *
+ * ------------------------------------------------------------------
+ */
+PriceWatch EStore::
+watch(int item_id, double threshold, Task task, TaskQueue* queue)
+{
+    PriceWatch h;
+    h.item_id = item_id;
+    h.threshold = threshold;
+    h.id = -1;
+    if (item_id < 0 || item_id >= INVENTORY_SIZE) return h;
+
+    Watch w;
+    w.id = h.id = nextWatchId.fetch_add(1, std::memory_order_relaxed);
+    w.task = task;
+    w.queue = queue;
+
+    lockWatches(item_id);
+    if (!watches[item_id]) watches[item_id] = new WatchIndex;
+    watches[item_id]->insert(std::make_pair(threshold, w));
+    vector<Watch> fired;
+    collectWatches_nolock(item_id, &fired);
+    unlockWatches(item_id);
+
+    dispatchWatches(fired);
+    return h;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * unwatch --
+ *
+ *      Cancel a watch that has not fired yet.
+ *
+ * Results:
+ *      true if the watch was still pending.
+ *
+ * ------------------------------------------------------------------
+ */
+bool EStore::
+unwatch(const PriceWatch& h)
+{
+    if (h.id < 0 || h.item_id < 0 || h.item_id >= INVENTORY_SIZE) return false;
+
+    bool found = false;
+    lockWatches(h.item_id);
+    WatchIndex* idx = watches[h.item_id];
+    if (idx) {
+        std::pair<WatchIndex::iterator, WatchIndex::iterator> r = idx->equal_range(h.threshold);
+        for (WatchIndex::iterator w = r.first; w != r.second; ++w) {
+            if (w->second.id == h.id) {
+                idx->erase(w);
+                found = true;
+                break;
+            }
+        }
+    }
+    unlockWatches(h.item_id);
+    return found;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * logMutation --
+ *
+ *      Append a record to the mutation log, if one is attached. Call
+ *      with the lock that serializes the change held: the item's
+ *      lock for item records, the store lock or global_mtx for the
+ *      global pricing records.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+logMutation(int type, int item_id, int quantity, double value, double value2)
+{
+    if (!mutationLog) return;
+    MutationRecord r;
+    r.type = type;
+    r.item_id = item_id;
+    r.quantity = quantity;
+    r.pad = 0;
+    r.value = value;
+    r.value2 = value2;
+    mutationLog->append(r);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * snapshot --
+ *
+ *      Copy the inventory and global pricing into image. Each item
+ *      is copied under its own lock, so the image is only a single
+ *      point in time if the store is quiescent.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void EStore::
+snapshot(StoreImage* image)
+{
+    if (!fineMode) {
+        smutex_lock(storeLock());
+        for (int i = 0; i < INVENTORY_SIZE; ++i) image->inventory[i] = inventory[i];
+        image->shippingCost = shippingCost;
+        image->storeDiscount = storeDiscount;
+        smutex_unlock(storeLock());
+    } else {
+        for (int i = 0; i < INVENTORY_SIZE; ++i) {
+            lockItem(i);
+            image->inventory[i] = inventory[i];
+            unlockItem(i);
+        }
+        globalPricing(&image->shippingCost, &image->storeDiscount);
+    }
+}
+
 /*
  * ------------------------------------------------------------------
  * buyItem --
@@ -81,11 +649,11 @@ buyItem(int item_id, double budget)
     assert(!fineModeEnabled());
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
-    smutex_lock(&mtx);
+    smutex_lock(storeLock());
 
     // If the store doesn't carry it, do nothing and return.
     if (!inventory[item_id].valid) {
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
         return;
     }
 
@@ -97,15 +665,16 @@ buyItem(int item_id, double budget)
         if (it.quantity > 0 && total <= budget) {
             // Buy it
             it.quantity -= 1;
-            smutex_unlock(&mtx);
+            logMutation(MUT_TAKE_STOCK, item_id, 1, 0, 0);
+            smutex_unlock(storeLock());
             return;
         }
         // Sleep until something about this item changes (stock/price/discount) or it’s removed.
-        scond_wait(&item_cv[item_id], &mtx);
+        scond_wait(itemCond(item_id), storeLock());
     }
 
     // If we reach here, the item was removed while we waited.
-    smutex_unlock(&mtx);
+    smutex_unlock(storeLock());
 }
 
 /*
@@ -174,8 +743,33 @@ buyManyItems(vector<int>* item_ids, double budget)
     discSnap = storeDiscount;
     smutex_unlock(&global_mtx);
 
-    for (int id : ids) {
-        smutex_lock(&item_mtx[id]);
+    // Lock in address order. Hosted stores may map several ids to the
+    // same stripe, so take each distinct lock once. If an item moved
+    // to another lock while we waited, let go of everything and retry.
+    std::vector<std::pair<smutex_t*, int> > held;
+    held.reserve(ids.size());
+    for (;;) {
+        held.clear();
+        for (int id : ids) held.push_back(std::make_pair(itemLock(id), id));
+        std::sort(held.begin(), held.end());
+        held.erase(std::unique(held.begin(), held.end(),
+                               [](const std::pair<smutex_t*, int>& a,
+                                  const std::pair<smutex_t*, int>& b) {
+                                   return a.first == b.first;
+                               }), held.end());
+        for (const std::pair<smutex_t*, int>& h : held) lockCounting(h.first, h.second);
+
+        bool moved = false;
+        for (int id : ids) {
+            smutex_t* m = itemLock(id);
+            bool found = false;
+            for (const std::pair<smutex_t*, int>& h : held) found |= h.first == m;
+            if (!found) { moved = true; break; }
+        }
+        if (!moved) break;
+        for (int i = static_cast<int>(held.size()) - 1; i >= 0; --i) {
+            smutex_unlock(held[i].first);
+        }
     }
 
     bool ok = true;
@@ -194,11 +788,13 @@ buyManyItems(vector<int>* item_ids, double budget)
     if (ok) {
         for (int id : ids) {
             inventory[id].quantity -= 1;
+            logMutation(MUT_TAKE_STOCK, id, 1, 0, 0);
         }
     }
 
-    for (int i = static_cast<int>(ids.size()) - 1; i >= 0; --i) {
-        smutex_unlock(&item_mtx[ids[i]]);
+    for (int id : ids) moveIfWanted_nolock(id);
+    for (int i = static_cast<int>(held.size()) - 1; i >= 0; --i) {
+        smutex_unlock(held[i].first);
     }
 }
 
@@ -220,23 +816,29 @@ addItem(int item_id, int quantity, double price, double discount)
 {
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
+    vector<Watch> fired;
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         Item &it = inventory[item_id];
         if (!it.valid) {
             it.valid = true; it.quantity = quantity; it.price = price; it.discount = discount;
-            scond_broadcast(&item_cv[item_id], &mtx);
+            logMutation(MUT_ADD_ITEM, item_id, quantity, price, discount);
+            scond_broadcast(itemCond(item_id), storeLock());
+            collectWatches_nolock(item_id, &fired);
         }
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         Item &it = inventory[item_id];
         if (!it.valid) {
             it.valid = true; it.quantity = quantity; it.price = price; it.discount = discount;
-            scond_broadcast(&item_cv_fine[item_id], &item_mtx[item_id]);
+            logMutation(MUT_ADD_ITEM, item_id, quantity, price, discount);
+            scond_broadcast(itemCondFine(item_id), itemLock(item_id));
+            collectWatches_nolock(item_id, &fired);
         }
-        smutex_unlock(&item_mtx[item_id]);
+        unlockItem(item_id);
     }
+    dispatchWatches(fired);
 }
 
 /*
@@ -260,15 +862,23 @@ removeItem(int item_id)
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         Item &it = inventory[item_id];
-        if (it.valid) { it.valid = false; scond_broadcast(&item_cv[item_id], &mtx); }
-        smutex_unlock(&mtx);
+        if (it.valid) {
+            it.valid = false;
+            logMutation(MUT_REMOVE_ITEM, item_id, 0, 0, 0);
+            scond_broadcast(itemCond(item_id), storeLock());
+        }
+        smutex_unlock(storeLock());
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         Item &it = inventory[item_id];
-        if (it.valid) { it.valid = false; scond_broadcast(&item_cv_fine[item_id], &item_mtx[item_id]); }
-        smutex_unlock(&item_mtx[item_id]);
+        if (it.valid) {
+            it.valid = false;
+            logMutation(MUT_REMOVE_ITEM, item_id, 0, 0, 0);
+            scond_broadcast(itemCondFine(item_id), itemLock(item_id));
+        }
+        unlockItem(item_id);
     }
 }
 
@@ -290,15 +900,23 @@ addStock(int item_id, int count)
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         Item &it = inventory[item_id];
-        if (it.valid && count > 0) { it.quantity += count; scond_broadcast(&item_cv[item_id], &mtx); }
-        smutex_unlock(&mtx);
+        if (it.valid && count > 0) {
+            it.quantity += count;
+            logMutation(MUT_ADD_STOCK, item_id, count, 0, 0);
+            scond_broadcast(itemCond(item_id), storeLock());
+        }
+        smutex_unlock(storeLock());
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         Item &it = inventory[item_id];
-        if (it.valid && count > 0) { it.quantity += count; scond_broadcast(&item_cv_fine[item_id], &item_mtx[item_id]); }
-        smutex_unlock(&item_mtx[item_id]);
+        if (it.valid && count > 0) {
+            it.quantity += count;
+            logMutation(MUT_ADD_STOCK, item_id, count, 0, 0);
+            scond_broadcast(itemCondFine(item_id), itemLock(item_id));
+        }
+        unlockItem(item_id);
     };
 }
 /*
@@ -308,7 +926,8 @@ addStock(int item_id, int count)
  *      Change the price on the item. If the store does not carry
  *      the item, do nothing.
  *
- *      If the item price decreased, wake any waiters.
+ *      If the item price decreased, wake any waiters and fire the
+ *      watches it crossed.
  *
  * Results:
  *      None.
@@ -320,25 +939,35 @@ priceItem(int item_id, double price)
 {
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
+    vector<Watch> fired;
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         Item &it = inventory[item_id];
         if (it.valid) {
             bool decreased = (price < it.price);
             it.price = price;
-            if (decreased) scond_broadcast(&item_cv[item_id], &mtx);
+            logMutation(MUT_PRICE_ITEM, item_id, 0, price, 0);
+            if (decreased) {
+                scond_broadcast(itemCond(item_id), storeLock());
+                collectWatches_nolock(item_id, &fired);
+            }
         }
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         Item &it = inventory[item_id];
         if (it.valid) {
             bool decreased = (price < it.price);
             it.price = price;
-            if (decreased) scond_broadcast(&item_cv_fine[item_id], &item_mtx[item_id]);
+            logMutation(MUT_PRICE_ITEM, item_id, 0, price, 0);
+            if (decreased) {
+                scond_broadcast(itemCondFine(item_id), itemLock(item_id));
+                collectWatches_nolock(item_id, &fired);
+            }
         }
-        smutex_unlock(&item_mtx[item_id]);
+        unlockItem(item_id);
     }
+    dispatchWatches(fired);
 }
 /*
  * ------------------------------------------------------------------
@@ -347,7 +976,8 @@ priceItem(int item_id, double price)
  *      Change the discount on the item. If the store does not carry
  *      the item, do nothing.
  *
- *      If the item discount increased, wake any waiters.
+ *      If the item discount increased, wake any waiters and fire
+ *      the watches it crossed.
  *
  * Results:
  *      None.
@@ -359,25 +989,35 @@ discountItem(int item_id, double discount)
 {
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return;
 
+    vector<Watch> fired;
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         Item &it = inventory[item_id];
         if (it.valid) {
             bool increased = (discount > it.discount);
             it.discount = discount;
-            if (increased) scond_broadcast(&item_cv[item_id], &mtx);
+            logMutation(MUT_DISCOUNT_ITEM, item_id, 0, discount, 0);
+            if (increased) {
+                scond_broadcast(itemCond(item_id), storeLock());
+                collectWatches_nolock(item_id, &fired);
+            }
         }
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         Item &it = inventory[item_id];
         if (it.valid) {
             bool increased = (discount > it.discount);
             it.discount = discount;
-            if (increased) scond_broadcast(&item_cv_fine[item_id], &item_mtx[item_id]);
+            logMutation(MUT_DISCOUNT_ITEM, item_id, 0, discount, 0);
+            if (increased) {
+                scond_broadcast(itemCondFine(item_id), itemLock(item_id));
+                collectWatches_nolock(item_id, &fired);
+            }
         }
-        smutex_unlock(&item_mtx[item_id]);
+        unlockItem(item_id);
     }
+    dispatchWatches(fired);
 }
 
 /*
@@ -385,7 +1025,7 @@ discountItem(int item_id, double discount)
  * setShippingCost --
  *
  *      Set the per-item shipping cost. If the shipping cost
- *      decreased, wake any waiters.
+ *      decreased, wake any waiters and fire crossed watches.
  *
  * Results:
  *      None.
@@ -395,30 +1035,37 @@ discountItem(int item_id, double discount)
 void EStore::
 setShippingCost(double cost)
 {
+    vector<Watch> fired;
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         bool decreased = (cost < shippingCost);
         shippingCost = cost;
+        logMutation(MUT_SET_SHIPPING_COST, -1, 0, cost, 0);
         if (decreased) {
-            for (int i = 0; i < INVENTORY_SIZE; ++i) scond_broadcast(&item_cv[i], &mtx);
+            for (int i = 0; i < INVENTORY_SIZE; ++i) {
+                scond_broadcast(itemCond(i), storeLock());
+                collectWatches_nolock(i, &fired);
+            }
         }
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
     } else {
         smutex_lock(&global_mtx);
         bool decreased = (cost < shippingCost);
         shippingCost = cost;
+        logMutation(MUT_SET_SHIPPING_COST, -1, 0, cost, 0);
         smutex_unlock(&global_mtx);
 
         if (decreased) {
             // Wake per-item waiters; each CV must be signaled with its own lock
             for (int i = 0; i < INVENTORY_SIZE; ++i) {
-                smutex_lock(&item_mtx[i]);
-                scond_broadcast(&item_cv_fine[i], &item_mtx[i]);
-                smutex_unlock(&item_mtx[i]);
+                lockItem(i);
+                scond_broadcast(itemCondFine(i), itemLock(i));
+                collectWatches_nolock(i, &fired);
+                unlockItem(i);
             }
         }
     }
-    smutex_unlock(&mtx);
+    dispatchWatches(fired);
 }
 
 /*
@@ -426,7 +1073,7 @@ setShippingCost(double cost)
  * setStoreDiscount --
  *
  *      Set the store discount. If the discount increased, wake any
- *      waiters.
+ *      waiters and fire crossed watches.
  *
  * Results:
  *      None.
@@ -436,29 +1083,36 @@ setShippingCost(double cost)
 void EStore::
 setStoreDiscount(double discount)
 {
+    vector<Watch> fired;
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         bool increased = (discount > storeDiscount);
         storeDiscount = discount;
+        logMutation(MUT_SET_STORE_DISCOUNT, -1, 0, discount, 0);
         if (increased) {
-            for (int i = 0; i < INVENTORY_SIZE; ++i) scond_broadcast(&item_cv[i], &mtx);
+            for (int i = 0; i < INVENTORY_SIZE; ++i) {
+                scond_broadcast(itemCond(i), storeLock());
+                collectWatches_nolock(i, &fired);
+            }
         }
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
     } else {
         smutex_lock(&global_mtx);
         bool increased = (discount > storeDiscount);
         storeDiscount = discount;
+        logMutation(MUT_SET_STORE_DISCOUNT, -1, 0, discount, 0);
         smutex_unlock(&global_mtx);
 
         if (increased) {
             for (int i = 0; i < INVENTORY_SIZE; ++i) {
-                smutex_lock(&item_mtx[i]);
-                scond_broadcast(&item_cv_fine[i], &item_mtx[i]);
-                smutex_unlock(&item_mtx[i]);
+                lockItem(i);
+                scond_broadcast(itemCondFine(i), itemLock(i));
+                collectWatches_nolock(i, &fired);
+                unlockItem(i);
             }
         }
     }
-    smutex_unlock(&mtx);
+    dispatchWatches(fired);
 }
 /*
  * ------------------------------------------------------------------
@@ -477,14 +1131,14 @@ getItemQuantity(int item_id)
     if (item_id < 0 || item_id >= INVENTORY_SIZE) return 0;
 
     if (!fineMode) {
-        smutex_lock(&mtx);
+        smutex_lock(storeLock());
         int q = (inventory[item_id].valid ? inventory[item_id].quantity : 0);
-        smutex_unlock(&mtx);
+        smutex_unlock(storeLock());
         return q;
     } else {
-        smutex_lock(&item_mtx[item_id]);
+        lockItem(item_id);
         int q = (inventory[item_id].valid ? inventory[item_id].quantity : 0);
-        smutex_unlock(&item_mtx[item_id]);
+        unlockItem(item_id);
         return q;
     }
 }
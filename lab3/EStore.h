@@ -1,7 +1,13 @@
 #pragma once
+#include <atomic>
+#include <map>
 #include <vector>
 #include "sthread.h"
 #include "Request.h"
+#include "TaskQueue.h"
+
+class MutationLog;
+struct StoreImage;
 /* 
  * ------------------------------------------------------------------
  * Item -- 
@@ -35,6 +41,75 @@ class Item {
 };
 
 
+/*
+ * ------------------------------------------------------------------
+ * LockStripes --
+ *
+ *      A fixed pool of mutex/condition variable pairs shared by many
+ *      EStore instances. Each (store, item) pair hashes to one
+ *      stripe, so the number of pthread objects is bounded by the
+ *      pool size instead of growing with the number of stores.
+ *
+ *      A condition variable is only ever waited on together with the
+ *      mutex of its own stripe.
+ *
+ * ------------------------------------------------------------------
+ */
+class LockStripes {
+    private:
+    struct Stripe {
+        smutex_t mtx;
+        scond_t  cv;
+    };
+    Stripe* stripes;
+    const int numStripes;
+
+    public:
+    explicit LockStripes(int count);
+    ~LockStripes();
+
+    LockStripes(const LockStripes&) = delete;
+    LockStripes& operator=(const LockStripes &) = delete;
+
+    int size() const { return numStripes; }
+    smutex_t* lock(int i) { return &stripes[i % numStripes].mtx; }
+    scond_t*  cond(int i) { return &stripes[i % numStripes].cv; }
+};
+
+
+// Hot item promotion (fine mode only).
+#define HOT_SLOTS           8      // dedicated lock slots per store
+#define HOT_SAMPLE_SEC      0.05   // contention sampling window
+#define HOT_PROMOTE_MIN     32     // contended acquires per window to promote
+#define HOT_DEMOTE_MAX      4      // at or below this, a hot item moves back
+
+/*
+ * One move of an item between its home lock and a dedicated slot.
+ */
+struct LockMigration {
+    double when;        // CLOCK_MONOTONIC seconds
+    int item_id;
+    bool promoted;      // true: home -> dedicated slot
+    long contended;     // contended acquires in the deciding window
+};
+
+/*
+ * ------------------------------------------------------------------
+ * PriceWatch --
+ *
+ *      Handle to a price-drop watch registered with EStore::watch.
+ *      Pass it to EStore::unwatch to cancel the watch. An id of -1
+ *      means the watch was rejected.
+ *
+ * ------------------------------------------------------------------
+ */
+struct PriceWatch {
+    int item_id;
+    double threshold;
+    long id;
+};
+
+
 /* 
  * ------------------------------------------------------------------
  * EStore -- 
@@ -60,22 +135,112 @@ class Item {
  *      that reference different item ids must process at the same
  *      time. The buyManyItems method only functions in this mode.
  *
+ *      A store constructed with a LockStripes pool is "hosted": it
+ *      owns no per-item pthread objects. Items map to stripes
+ *      starting at stripeSalt, so neighbouring stores spread over
+ *      the pool. Unrelated items may then share a stripe, which only
+ *      costs spurious wakeups.
+ *
+ *      Clients can watch an item for its overall cost (as defined in
+ *      buyItem) dropping to a threshold. Each item keeps its watches
+ *      in a map ordered by threshold, under the item's lock, so a
+ *      cost decrease fires exactly the crossed watches in
+ *      O(log n + fired). Items nobody watches pay one pointer test.
+ *
+ *      In fine mode the store samples lock contention per item
+ *      (acquires that found the item's lock busy). Every
+ *      HOT_SAMPLE_SEC, the hottest items move from their home lock
+ *      (the store's own per-item lock, or a shared stripe) to one of
+ *      HOT_SLOTS dedicated, cache-line padded lock slots. Items that
+ *      cool down move back. A move is carried out by the lock
+ *      holder when it unlocks. Lockers re-check the item's lock
+ *      after acquiring it and retry if the item moved meanwhile.
+ *      Fine mode never waits on item condition variables, so nobody
+ *      can be parked on a lock's condition variable when it moves.
+ *
+ *      With a MutationLog attached, every change that takes effect
+ *      is appended to it (see MutationLog.h); flush the log once the
+ *      store is quiescent, before reading it.
+ *
  * ------------------------------------------------------------------
  */
 class EStore {
     private:
-        smutex_t mtx;
-        scond_t  item_cv[INVENTORY_SIZE];
+        // Synchronization objects of a standalone store. A hosted store
+        // leaves this null and borrows locks from a shared LockStripes.
+        struct OwnedSync {
+            smutex_t mtx;
+            scond_t  item_cv[INVENTORY_SIZE];
+
+            // fine-grained mode (one lock/cond per item)
+            smutex_t item_mtx[INVENTORY_SIZE];
+            scond_t  item_cv_fine[INVENTORY_SIZE];
+        };
+        OwnedSync*   owned;
+        LockStripes* stripes;
+        int          stripeBase;
+
         double   shippingCost;
         double   storeDiscount;
 
-        // NEW: fine-grained mode (one lock/cond per item)
-        smutex_t item_mtx[INVENTORY_SIZE];
-        scond_t  item_cv_fine[INVENTORY_SIZE];
-
-        // NEW: protect global fields in fine mode
+        // protect global fields in fine mode
         smutex_t global_mtx;
 
+        // Price-drop watches. Every watch in an item's index has a
+        // threshold below the item's cost when last evaluated. Guarded
+        // by the item's lock (the store lock in coarse mode); allocated
+        // on the first watch.
+        struct Watch {
+            long id;
+            Task task;
+            TaskQueue* queue;
+        };
+        typedef std::multimap<double, Watch> WatchIndex;
+        WatchIndex* watches[INVENTORY_SIZE];
+        std::atomic<long> nextWatchId;
+
+        void lockWatches(int item_id);
+        void unlockWatches(int item_id);
+        void globalPricing(double* ship, double* discount);
+        void collectWatches_nolock(int item_id, std::vector<Watch>* fired);
+        static void dispatchWatches(const std::vector<Watch>& fired);
+
+        MutationLog* mutationLog;
+        void logMutation(int type, int item_id, int quantity, double value, double value2);
+
+        smutex_t* storeLock();
+        scond_t*  itemCond(int item_id);
+        smutex_t* itemLock(int item_id);
+        scond_t*  itemCondFine(int item_id);
+        smutex_t* homeLock(int item_id);
+        scond_t*  homeCond(int item_id);
+
+        // Hot item promotion. hotSlot is where an item's lock lives
+        // now (null: home), wantSlot where the sampler wants it (slot
+        // index + 1, 0: home). Only the item's lock holder changes
+        // hotSlot. Slots are allocated on the first promotion.
+        struct alignas(64) HotSlot {
+            smutex_t mtx;
+            scond_t  cv;
+        };
+        HotSlot* hotSlots;
+        std::atomic<HotSlot*> hotSlot[INVENTORY_SIZE];
+        std::atomic<int> wantSlot[INVENTORY_SIZE];
+        std::atomic<long> contended[INVENTORY_SIZE];
+
+        // sampler state, guarded by sample_mtx
+        smutex_t sample_mtx;
+        double nextSample;
+        int slotOwner[HOT_SLOTS];
+        long lastContended[INVENTORY_SIZE];
+        std::vector<LockMigration> migrations;
+
+        void lockItem(int item_id);
+        void unlockItem(int item_id);
+        void lockCounting(smutex_t* m, int item_id);
+        void moveIfWanted_nolock(int item_id);
+        void sampleContention();
+
         inline double itemCurrentPrice_nolock(const Item& it) const {
             return it.price * (1.0 - it.discount);
         }
@@ -87,6 +252,7 @@ class EStore {
     public:
 
     explicit EStore(bool enableFineMode);
+    EStore(bool enableFineMode, LockStripes* sharedStripes, int stripeSalt);
     ~EStore();
 
     // no default copy constructor and assignment operators. this will prevent some
@@ -106,6 +272,15 @@ class EStore {
     void buyManyItems(std::vector<int>* item_ids, double budget);
     int getItemQuantity(int item_id);
 
+    PriceWatch watch(int item_id, double threshold, Task task, TaskQueue* queue = nullptr);
+    bool unwatch(const PriceWatch& w);
+
+    // Attach before the store is shared between threads.
+    void setMutationLog(MutationLog* log) { mutationLog = log; }
+    void snapshot(StoreImage* image);
+
+    std::vector<LockMigration> getLockMigrations();
+
     bool fineModeEnabled() const { return fineMode; }
 };
 
@@ -0,0 +1,161 @@
+#include <cassert>
+#include <ctime>
+
+#include "FairTaskQueue.h"
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+FairTaskQueue::
+FairTaskQueue()
+    : cursor(0)
+{ }
+
+FairTaskQueue::
+~FairTaskQueue()
+{ }
+
+/*
+ * ------------------------------------------------------------------
+ * laneFor --
+ *
+ *      Find the lane for a handler, creating it with weight 1 if
+ *      this is the first task of its type. Must be called with mtx
+ *      held.
+ *
+ * Results:
+ *      The lane.
+ *
+ * ------------------------------------------------------------------
+ */
+FairTaskQueue::Lane* FairTaskQueue::
+laneFor(handler_t handler)
+{
+    for (Lane& l : lanes) {
+        if (l.stats.handler == handler) return &l;
+    }
+    Lane l;
+    l.stats.handler = handler;
+    l.stats.weight = 1;
+    l.stats.dispatched = 0;
+    l.stats.totalWait = 0;
+    l.stats.maxWait = 0;
+    l.deficit = 0;
+    lanes.push_back(l);
+    return &lanes.back();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * setWeight --
+ *
+ *      Set the number of tasks of this type served per round. 0
+ *      makes the type background work.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void FairTaskQueue::
+setWeight(handler_t handler, int weight)
+{
+    assert(weight >= 0);
+    smutex_lock(&mtx);
+    laneFor(handler)->stats.weight = weight;
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * getTypeStats --
+ *
+ *      Return the dispatch and queueing-delay counters of every
+ *      lane.
+ *
+ * Results:
+ *      One entry per request type seen so far.
+ *
+ * ------------------------------------------------------------------
+ */
+std::vector<FairTaskQueueTypeStats> FairTaskQueue::
+getTypeStats()
+{
+    std::vector<FairTaskQueueTypeStats> out;
+    smutex_lock(&mtx);
+    for (const Lane& l : lanes) out.push_back(l.stats);
+    smutex_unlock(&mtx);
+    return out;
+}
+
+void FairTaskQueue::
+storePush(Task task)
+{
+    Pending p;
+    p.task = task;
+    p.enqueuedAt = now_sec();
+    laneFor(task.handler)->q.push_back(p);
+}
+
+void FairTaskQueue::
+dispatchFrom(Lane* lane, Task* task)
+{
+    Pending p = lane->q.front();
+    lane->q.pop_front();
+    double wait = now_sec() - p.enqueuedAt;
+    lane->stats.dispatched++;
+    lane->stats.totalWait += wait;
+    if (wait > lane->stats.maxWait) lane->stats.maxWait = wait;
+    *task = p.task;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * storePop --
+ *
+ *      Take the next task in deficit round robin order. Must be
+ *      called with mtx held.
+ *
+ * Results:
+ *      false if every lane is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool FairTaskQueue::
+storePop(Task* task)
+{
+    int n = static_cast<int>(lanes.size());
+    if (n == 0) return false;
+
+    // Weighted lanes first. Every empty lane passed forfeits its
+    // deficit, so one full cycle either finds work or proves there
+    // is none.
+    for (int scanned = 0; scanned <= n; ++scanned) {
+        Lane& l = lanes[cursor];
+        if (l.stats.weight == 0 || l.q.empty()) {
+            l.deficit = 0;
+            cursor = (cursor + 1) % n;
+            continue;
+        }
+        if (l.deficit <= 0) l.deficit += l.stats.weight;
+        dispatchFrom(&l, task);
+        if (--l.deficit <= 0 || l.q.empty()) {
+            if (l.q.empty()) l.deficit = 0;
+            cursor = (cursor + 1) % n;
+        }
+        return true;
+    }
+
+    for (Lane& l : lanes) {
+        if (!l.q.empty()) {
+            dispatchFrom(&l, task);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+#include <deque>
+#include <vector>
+
+#include "TaskQueue.h"
+
+// Per-type counters kept by a FairTaskQueue.
+struct FairTaskQueueTypeStats {
+    handler_t handler;
+    int weight;
+    long dispatched;
+    double totalWait;    // seconds between enqueue and dispatch
+    double maxWait;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * FairTaskQueue --
+ *
+ *      A TaskQueue that keeps one FIFO lane per request type, where
+ *      the type of a task is its handler. Lanes are created on
+ *      first use with weight 1.
+ *
+ *      dequeue picks lanes by deficit round robin. When the cursor
+ *      reaches a backlogged lane, the lane's deficit grows by its
+ *      weight. The lane is then served one task per dequeue until
+ *      the deficit is spent or the lane empties, and the cursor
+ *      moves on. A lane with weight w thus gets w dispatches per
+ *      round, and a flood of one type cannot hold cheap requests
+ *      of another type behind it.
+ *
+ *      A lane of weight 0 is background work: it is only served
+ *      when every weighted lane is empty. Stop requests belong
+ *      there, so workers drain real work before exiting.
+ *
+ * ------------------------------------------------------------------
+ */
+class FairTaskQueue : public TaskQueue {
+    private:
+    struct Pending {
+        Task task;
+        double enqueuedAt;
+    };
+
+    struct Lane {
+        FairTaskQueueTypeStats stats;
+        int deficit;
+        std::deque<Pending> q;
+    };
+
+    std::vector<Lane> lanes;
+    int cursor;
+
+    Lane* laneFor(handler_t handler);
+    void dispatchFrom(Lane* lane, Task* task);
+
+    protected:
+    virtual void storePush(Task task);
+    virtual bool storePop(Task* task);
+
+    public:
+    FairTaskQueue();
+    virtual ~FairTaskQueue();
+
+    void setWeight(handler_t handler, int weight);
+    std::vector<FairTaskQueueTypeStats> getTypeStats();
+};
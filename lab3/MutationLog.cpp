@@ -0,0 +1,400 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+
+#include "MutationLog.h"
+
+#define CHUNK_SHIFT   16
+#define CHUNK_RECORDS (1L << CHUNK_SHIFT)
+
+static_assert(sizeof(MutationRecord) == 32, "log records must stay fixed-size");
+
+StoreImage::
+StoreImage()
+    : shippingCost(3), storeDiscount(0)
+{
+    for (int i = 0; i < INVENTORY_SIZE; ++i) {
+        inventory[i].quantity = 0;
+        inventory[i].price = 0;
+        inventory[i].discount = 0;
+    }
+}
+
+bool StoreImage::
+operator==(const StoreImage& o) const
+{
+    if (shippingCost != o.shippingCost || storeDiscount != o.storeDiscount) return false;
+    for (int i = 0; i < INVENTORY_SIZE; ++i) {
+        const Item& a = inventory[i];
+        const Item& b = o.inventory[i];
+        if (a.valid != b.valid || a.quantity != b.quantity
+            || a.price != b.price || a.discount != b.discount) return false;
+    }
+    return true;
+}
+
+MutationLog::
+MutationLog()
+    : count(0)
+{
+    smutex_init(&mtx);
+    for (Stripe& s : stripes) {
+        smutex_init(&s.mtx);
+        s.pending.reserve(LOG_STRIPE_RECORDS);
+    }
+}
+
+MutationLog::
+~MutationLog()
+{
+    clear();
+    for (Stripe& s : stripes) smutex_destroy(&s.mtx);
+    smutex_destroy(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * append --
+ *
+ *      Append a record to its stripe's buffer, moving the buffer to
+ *      the end of the log when it fills up.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void MutationLog::
+append(const MutationRecord& r)
+{
+    Stripe& s = stripes[(unsigned) (r.item_id + 1) % LOG_STRIPES];
+    smutex_lock(&s.mtx);
+    s.pending.push_back(r);
+    if (s.pending.size() == LOG_STRIPE_RECORDS) {
+        // Still holding the stripe, so its next batch lands after this one.
+        smutex_lock(&mtx);
+        appendLocked(s.pending.data(), LOG_STRIPE_RECORDS);
+        smutex_unlock(&mtx);
+        s.pending.clear();
+    }
+    smutex_unlock(&s.mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * flush --
+ *
+ *      Move every record still buffered by a stripe to the end of
+ *      the log. Call once writers are done, before size(), at() or
+ *      replay.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void MutationLog::
+flush()
+{
+    for (Stripe& s : stripes) {
+        smutex_lock(&s.mtx);
+        smutex_lock(&mtx);
+        appendLocked(s.pending.data(), (long) s.pending.size());
+        smutex_unlock(&mtx);
+        s.pending.clear();
+        smutex_unlock(&s.mtx);
+    }
+}
+
+void MutationLog::
+appendLocked(const MutationRecord* rs, long n)
+{
+    for (long i = 0; i < n; ++i) {
+        if ((count & (CHUNK_RECORDS - 1)) == 0
+            && (long) chunks.size() == count >> CHUNK_SHIFT) {
+            chunks.push_back(new MutationRecord[CHUNK_RECORDS]);
+        }
+        chunks[count >> CHUNK_SHIFT][count & (CHUNK_RECORDS - 1)] = rs[i];
+        ++count;
+    }
+}
+
+void MutationLog::
+clear()
+{
+    for (Stripe& s : stripes) {
+        smutex_lock(&s.mtx);
+        s.pending.clear();
+        smutex_unlock(&s.mtx);
+    }
+    smutex_lock(&mtx);
+    for (MutationRecord* c : chunks) delete[] c;
+    chunks.clear();
+    count = 0;
+    smutex_unlock(&mtx);
+}
+
+const MutationRecord& MutationLog::
+at(long i) const
+{
+    assert(0 <= i && i < count);
+    return chunks[i >> CHUNK_SHIFT][i & (CHUNK_RECORDS - 1)];
+}
+
+/*
+ * ------------------------------------------------------------------
+ * writeFile, readFile --
+ *
+ *      Save the log (flushed first) as raw records, or replace the
+ *      log with the records of a file.
+ *
+ * Results:
+ *      false on an I/O error, or a truncated file or invalid record
+ *      (see isValidMutation), which leave the log empty.
+ *
+ * ------------------------------------------------------------------
+ */
+bool MutationLog::
+writeFile(const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) return false;
+    flush();
+    smutex_lock(&mtx);
+    bool ok = true;
+    for (long done = 0; ok && done < count; done += CHUNK_RECORDS) {
+        long n = count - done < CHUNK_RECORDS ? count - done : CHUNK_RECORDS;
+        ok = fwrite(chunks[done >> CHUNK_SHIFT], sizeof(MutationRecord), n, f) == (size_t) n;
+    }
+    smutex_unlock(&mtx);
+    return fclose(f) == 0 && ok;
+}
+
+bool MutationLog::
+readFile(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return false;
+    clear();
+    // A partial record at the end means the file was cut short.
+    long bytes = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    if (bytes < 0 || bytes % sizeof(MutationRecord) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fclose(f);
+        return false;
+    }
+    smutex_lock(&mtx);
+    bool ok = true;
+    for (;;) {
+        MutationRecord* c = new MutationRecord[CHUNK_RECORDS];
+        size_t n = fread(c, sizeof(MutationRecord), CHUNK_RECORDS, f);
+        if (n == 0) {
+            delete[] c;
+            break;
+        }
+        chunks.push_back(c);
+        count += n;
+        for (size_t i = 0; ok && i < n; ++i) ok = isValidMutation(c[i]);
+        if (!ok || n < (size_t) CHUNK_RECORDS) break;
+    }
+    ok = ok && !ferror(f);
+    smutex_unlock(&mtx);
+    fclose(f);
+    if (!ok) clear();
+    return ok;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * applyMutation --
+ *
+ *      Apply one record to a store image, skipping invalid ones.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static inline void
+applyMutation(const MutationRecord& r, StoreImage* image)
+{
+    if (!isValidMutation(r)) return;
+    switch (r.type) {
+    case MUT_SET_SHIPPING_COST:
+        image->shippingCost = r.value;
+        return;
+    case MUT_SET_STORE_DISCOUNT:
+        image->storeDiscount = r.value;
+        return;
+    default:
+        break;
+    }
+
+    Item& it = image->inventory[r.item_id];
+    switch (r.type) {
+    case MUT_ADD_ITEM:
+        it.valid = true;
+        it.quantity = r.quantity;
+        it.price = r.value;
+        it.discount = r.value2;
+        break;
+    case MUT_REMOVE_ITEM:
+        it.valid = false;
+        break;
+    case MUT_ADD_STOCK:
+        it.quantity += r.quantity;
+        break;
+    case MUT_TAKE_STOCK:
+        it.quantity -= r.quantity;
+        break;
+    case MUT_PRICE_ITEM:
+        it.price = r.value;
+        break;
+    case MUT_DISCOUNT_ITEM:
+        it.discount = r.value;
+        break;
+    default:
+        assert(false);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replaySequential --
+ *
+ *      Apply every record of the log to image, in log order, on the
+ *      calling thread.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+replaySequential(const MutationLog& log, StoreImage* image)
+{
+    long n = log.size();
+    for (long i = 0; i < n; ++i) applyMutation(log.at(i), image);
+}
+
+/*
+ * Parallel replay runs in two phases. Split workers each take a
+ * contiguous range of the log and bucket its item records by
+ * partition, remembering the last global record of each kind. Apply
+ * workers then each own one partition (a contiguous block of item
+ * ids) and replay its buckets in range order.
+ */
+struct SplitWorker {
+    const MutationLog* log;
+    long begin;
+    long end;
+    int numParts;
+    std::vector<MutationRecord>* buckets;
+    long lastShipping;
+    long lastDiscount;
+};
+
+struct ApplyWorker {
+    std::vector<SplitWorker>* splits;
+    int part;
+    StoreImage* image;
+};
+
+static inline int
+partitionOf(int item_id, int numParts)
+{
+    // Blocks of neighbouring ids, so partitions do not share cache lines.
+    return (int) ((long) item_id * numParts / INVENTORY_SIZE);
+}
+
+static void*
+splitRange(void* arg)
+{
+    SplitWorker* w = static_cast<SplitWorker*>(arg);
+    long expect = (w->end - w->begin) / w->numParts + 1;
+    for (int p = 0; p < w->numParts; ++p) w->buckets[p].reserve(expect + expect / 8);
+    for (long i = w->begin; i < w->end; ++i) {
+        const MutationRecord& r = w->log->at(i);
+        if (r.type == MUT_SET_SHIPPING_COST) {
+            w->lastShipping = i;
+        } else if (r.type == MUT_SET_STORE_DISCOUNT) {
+            w->lastDiscount = i;
+        } else if (isValidMutation(r)) {
+            w->buckets[partitionOf(r.item_id, w->numParts)].push_back(r);
+        }
+    }
+    return nullptr;
+}
+
+static void*
+applyPartition(void* arg)
+{
+    ApplyWorker* w = static_cast<ApplyWorker*>(arg);
+    for (SplitWorker& s : *w->splits) {
+        for (const MutationRecord& r : s.buckets[w->part]) applyMutation(r, w->image);
+    }
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replayParallel --
+ *
+ *      Apply the log to image like replaySequential, using
+ *      numThreads threads.
+ *
+ *      Global pricing records order the log into epochs. No item
+ *      record reads global pricing (a purchase is logged by its
+ *      outcome), so partitions do not have to meet at every epoch
+ *      boundary. Each partition keeps the log order of its items,
+ *      and the global fields end up with their last logged values,
+ *      which is all the sequential replay can observe.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void
+replayParallel(const MutationLog& log, StoreImage* image, int numThreads)
+{
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > INVENTORY_SIZE) numThreads = INVENTORY_SIZE;
+    if (numThreads == 1) {
+        replaySequential(log, image);
+        return;
+    }
+
+    long n = log.size();
+    std::vector<SplitWorker> splits(numThreads);
+    std::vector<sthread_t> threads(numThreads);
+    for (int t = 0; t < numThreads; ++t) {
+        SplitWorker& s = splits[t];
+        s.log = &log;
+        s.begin = n * t / numThreads;
+        s.end = n * (t + 1) / numThreads;
+        s.numParts = numThreads;
+        s.buckets = new std::vector<MutationRecord>[numThreads];
+        s.lastShipping = s.lastDiscount = -1;
+        sthread_create(&threads[t], splitRange, &s);
+    }
+    for (int t = 0; t < numThreads; ++t) sthread_join(threads[t]);
+
+    std::vector<ApplyWorker> appliers(numThreads);
+    for (int t = 0; t < numThreads; ++t) {
+        appliers[t].splits = &splits;
+        appliers[t].part = t;
+        appliers[t].image = image;
+        sthread_create(&threads[t], applyPartition, &appliers[t]);
+    }
+
+    long lastShipping = -1, lastDiscount = -1;
+    for (const SplitWorker& s : splits) {
+        if (s.lastShipping > lastShipping) lastShipping = s.lastShipping;
+        if (s.lastDiscount > lastDiscount) lastDiscount = s.lastDiscount;
+    }
+    if (lastShipping >= 0) applyMutation(log.at(lastShipping), image);
+    if (lastDiscount >= 0) applyMutation(log.at(lastDiscount), image);
+
+    for (int t = 0; t < numThreads; ++t) sthread_join(threads[t]);
+    for (SplitWorker& s : splits) delete[] s.buckets;
+}
@@ -0,0 +1,132 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "sthread.h"
+#include "EStore.h"
+
+enum MutationType {
+    MUT_ADD_ITEM = 0,
+    MUT_REMOVE_ITEM,
+    MUT_ADD_STOCK,
+    MUT_TAKE_STOCK,
+    MUT_PRICE_ITEM,
+    MUT_DISCOUNT_ITEM,
+    MUT_SET_SHIPPING_COST,
+    MUT_SET_STORE_DISCOUNT,
+    NUM_MUTATION_TYPES
+};
+
+/*
+ * One fixed-size log record. Item records carry the item id; the
+ * two global pricing records use item_id -1.
+ */
+struct MutationRecord {
+    int32_t type;
+    int32_t item_id;
+    int32_t quantity;
+    int32_t pad;
+    double  value;     // price, discount or cost
+    double  value2;    // discount of MUT_ADD_ITEM
+};
+
+static inline bool
+isGlobalMutation(const MutationRecord& r)
+{
+    return r.type == MUT_SET_SHIPPING_COST || r.type == MUT_SET_STORE_DISCOUNT;
+}
+
+/*
+ * A record replay can apply: a known type, and an item id in range
+ * for item records. Logs read from a file may hold anything.
+ */
+static inline bool
+isValidMutation(const MutationRecord& r)
+{
+    if (r.type < 0 || r.type >= NUM_MUTATION_TYPES) return false;
+    return isGlobalMutation(r) || (r.item_id >= 0 && r.item_id < INVENTORY_SIZE);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * StoreImage --
+ *
+ *      The replayable state of an EStore: the inventory and the
+ *      global pricing, starting out like a freshly built store.
+ *
+ * ------------------------------------------------------------------
+ */
+struct StoreImage {
+    Item inventory[INVENTORY_SIZE];
+    double shippingCost;
+    double storeDiscount;
+
+    StoreImage();
+    bool operator==(const StoreImage& o) const;
+};
+
+/*
+ * ------------------------------------------------------------------
+ * MutationLog --
+ *
+ *      An append-only log of the state changes an EStore made. The
+ *      store only logs changes that took effect, after its own
+ *      checks, so replay applies records blindly. A purchase is
+ *      logged as one MUT_TAKE_STOCK per item bought.
+ *
+ *      Records of an item are appended under that item's lock, so
+ *      their order in the log is the order the store applied them.
+ *      Records are kept in fixed-size chunks, so appending never
+ *      copies old records.
+ *
+ *      Writers do not meet on one mutex per record: append() buffers
+ *      a record in one of LOG_STRIPES stripes, chosen by item id, and
+ *      moves a full stripe buffer into the chunks in one go. All
+ *      records of an item (and all global records) share a stripe,
+ *      so they keep their order; records of different items may be
+ *      reordered, which replay cannot observe. flush() moves what is
+ *      still buffered once writers are done.
+ *
+ *      This class is implemented as a monitor.
+ *
+ * ------------------------------------------------------------------
+ */
+#define LOG_STRIPES        16
+#define LOG_STRIPE_RECORDS 1024
+
+class MutationLog {
+    private:
+    std::vector<MutationRecord*> chunks;
+    long count;
+
+    smutex_t mtx;
+
+    struct alignas(64) Stripe {
+        smutex_t mtx;
+        std::vector<MutationRecord> pending;
+    };
+    Stripe stripes[LOG_STRIPES];
+
+    void appendLocked(const MutationRecord* rs, long n);
+
+    public:
+    MutationLog();
+    ~MutationLog();
+
+    MutationLog(const MutationLog&) = delete;
+    MutationLog& operator=(const MutationLog &) = delete;
+
+    void append(const MutationRecord& r);
+    void flush();
+    void clear();
+
+    // Not synchronized with append: call flush() once writers are done.
+    long size() const { return count; }
+    const MutationRecord& at(long i) const;
+
+    bool writeFile(const char* path);
+    bool readFile(const char* path);
+};
+
+void replaySequential(const MutationLog& log, StoreImage* image);
+void replayParallel(const MutationLog& log, StoreImage* image, int numThreads);
@@ -59,6 +59,27 @@ enqueueTasks(int maxTasks, EStore* store)
     }
 }
 
+/*
+ * ------------------------------------------------------------------
+ * nextTask --
+ *
+ *      Generate one request against "store" without enqueuing it.
+ *      Used by callers that route tasks themselves, such as the
+ *      multi-tenant StoreHost.
+ *
+ * Results:
+ *      The generated task.
+ *
+ * ------------------------------------------------------------------
+ */
+Task RequestGenerator::
+nextTask(EStore* store)
+{
+    Task task = generateTask(store);
+    taskCount++;
+    return task;
+}
+
 /*
  * ------------------------------------------------------------------
  * enqueueStops --
@@ -19,6 +19,7 @@ class RequestGenerator {
 
     void enqueueTasks(int maxTasks, EStore* store);
     void enqueueStops(int num);
+    Task nextTask(EStore* store);
 };
 
 class SupplierRequestGenerator : public RequestGenerator {
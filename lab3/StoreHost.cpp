@@ -0,0 +1,171 @@
+#include <cassert>
+
+#include "StoreHost.h"
+#include "RequestHandlers.h"
+
+StoreHost::Tenant::
+Tenant(LockStripes* stripes, int salt)
+    : store(true, stripes, salt), head(nullptr), tail(nullptr),
+      nextRunnable(nullptr), runnable(false)
+{ }
+
+StoreHost::
+StoreHost(int numTenants, int numStripes)
+    : stripes(numStripes), runHead(nullptr), runTail(nullptr),
+      freeNodes(nullptr), pendingStops(0)
+{
+    assert(numTenants > 0);
+    tenants.reserve(numTenants);
+    for (int i = 0; i < numTenants; ++i) {
+        // Spread the tenants' first items over the pool.
+        tenants.push_back(new Tenant(&stripes, (i * INVENTORY_SIZE) % numStripes));
+    }
+    smutex_init(&mtx);
+    scond_init(&work_ready);
+}
+
+StoreHost::
+~StoreHost()
+{
+    for (Tenant* t : tenants) {
+        while (t->head) {
+            TaskNode* n = t->head;
+            t->head = n->next;
+            delete n;
+        }
+        delete t;
+    }
+    while (freeNodes) {
+        TaskNode* n = freeNodes;
+        freeNodes = n->next;
+        delete n;
+    }
+    scond_destroy(&work_ready);
+    smutex_destroy(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * submit --
+ *
+ *      Queue the task for the given tenant. If the tenant had no
+ *      pending work, put it at the back of the round-robin ring.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StoreHost::
+submit(int tenant, Task task)
+{
+    assert(0 <= tenant && tenant < numTenants());
+
+    smutex_lock(&mtx);
+    TaskNode* n = freeNodes;
+    if (n) {
+        freeNodes = n->next;
+    } else {
+        n = new TaskNode;
+    }
+    n->task = task;
+    n->next = nullptr;
+
+    Tenant* t = tenants[tenant];
+    if (t->tail) {
+        t->tail->next = n;
+    } else {
+        t->head = n;
+    }
+    t->tail = n;
+
+    if (!t->runnable) {
+        t->runnable = true;
+        t->nextRunnable = nullptr;
+        if (runTail) {
+            runTail->nextRunnable = t;
+        } else {
+            runHead = t;
+        }
+        runTail = t;
+        scond_signal(&work_ready, &mtx);
+    }
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * stopWorkers --
+ *
+ *      Queue "num" stop requests, one per worker thread. They are
+ *      handed out after all tenant work has drained.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void StoreHost::
+stopWorkers(int num)
+{
+    smutex_lock(&mtx);
+    pendingStops += num;
+    scond_broadcast(&work_ready, &mtx);
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * next --
+ *
+ *      Take one task from the tenant at the head of the ring. If
+ *      that tenant still has work, it moves to the back of the ring.
+ *      Block until a task or a stop request is available.
+ *
+ * Results:
+ *      The next task to execute.
+ *
+ * ------------------------------------------------------------------
+ */
+Task StoreHost::
+next()
+{
+    smutex_lock(&mtx);
+    while (!runHead && pendingStops == 0) {
+        scond_wait(&work_ready, &mtx);
+    }
+
+    Task task;
+    if (!runHead) {
+        --pendingStops;
+        task.handler = stop_handler;
+        task.arg = nullptr;
+        smutex_unlock(&mtx);
+        return task;
+    }
+
+    Tenant* t = runHead;
+    runHead = t->nextRunnable;
+    if (!runHead) runTail = nullptr;
+
+    TaskNode* n = t->head;
+    t->head = n->next;
+    if (!t->head) t->tail = nullptr;
+    task = n->task;
+    n->next = freeNodes;
+    freeNodes = n;
+
+    if (t->head) {
+        t->nextRunnable = nullptr;
+        if (runTail) {
+            runTail->nextRunnable = t;
+        } else {
+            runHead = t;
+        }
+        runTail = t;
+    } else {
+        t->runnable = false;
+    }
+    smutex_unlock(&mtx);
+    return task;
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <vector>
+
+#include "sthread.h"
+#include "EStore.h"
+#include "TaskQueue.h"
+
+/*
+ * ------------------------------------------------------------------
+ * StoreHost --
+ *
+ *      Hosts many EStore instances (tenants) in one process, served
+ *      by a shared pool of worker threads.
+ *
+ *      Every tenant has its own inventory and global pricing, but no
+ *      pthread objects of its own: item locks come from one
+ *      LockStripes pool shared by all tenants. Tenants run in fine
+ *      mode, so no request ever parks a shared worker on a
+ *      condition variable.
+ *
+ *      Tasks are queued per tenant. Tenants with pending work sit
+ *      in a round-robin ring and next() hands out one task per turn,
+ *      so a hot tenant gets at most its fair share of the workers
+ *      while other tenants have work.
+ *
+ *      Stop tasks queued by stopWorkers() are only handed out once
+ *      no tenant has work left.
+ *
+ *      This class is implemented as a monitor.
+ *
+ * ------------------------------------------------------------------
+ */
+class StoreHost {
+    private:
+    struct TaskNode {
+        Task task;
+        TaskNode* next;
+    };
+
+    struct Tenant {
+        EStore store;
+        TaskNode* head;
+        TaskNode* tail;
+        Tenant* nextRunnable;
+        bool runnable;
+
+        Tenant(LockStripes* stripes, int salt);
+    };
+
+    LockStripes stripes;
+    std::vector<Tenant*> tenants;
+
+    // ring of tenants with pending work
+    Tenant* runHead;
+    Tenant* runTail;
+
+    // recycled task nodes
+    TaskNode* freeNodes;
+    int pendingStops;
+
+    smutex_t mtx;
+    scond_t  work_ready;
+
+    public:
+    StoreHost(int numTenants, int numStripes);
+    ~StoreHost();
+
+    StoreHost(const StoreHost&) = delete;
+    StoreHost& operator=(const StoreHost &) = delete;
+
+    int numTenants() const { return static_cast<int>(tenants.size()); }
+    EStore* store(int tenant) { return &tenants[tenant]->store; }
+
+    void submit(int tenant, Task task);
+    void stopWorkers(int num);
+    Task next();
+};
@@ -1,9 +1,52 @@
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <ctime>
 
 #include "TaskQueue.h"
+#include "TimerWheel.h"
+
+// Floor of the self-tuning spin budget, in spin iterations.
+#define SPIN_MIN_ITERS 16
+
+static inline void
+cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 TaskQueue::
 TaskQueue()
+    : poolSize(0), freeNodes(nullptr), head(nullptr), tail(nullptr), count(0),
+      readyCount(0), sleepers(0), spinMax(0), spinLimit(0),
+      timers(nullptr), timerEpoch(0), timerKeeper(false), keeperWakeup(0)
+{
+    memset(&waitStats, 0, sizeof(waitStats));
+    smutex_init(&mtx);
+    scond_init(&not_empty);
+}
+
+TaskQueue::
+TaskQueue(int poolSize)
+    : poolSize(poolSize), freeNodes(nullptr), head(nullptr), tail(nullptr), count(0),
+      readyCount(0), sleepers(0), spinMax(0), spinLimit(0),
+      timers(nullptr), timerEpoch(0), timerKeeper(false), keeperWakeup(0)
 {
+    assert(poolSize > 0);
+    memset(&waitStats, 0, sizeof(waitStats));
+    growPool();
     smutex_init(&mtx);
     scond_init(&not_empty);
 }
@@ -11,10 +54,58 @@ TaskQueue()
 TaskQueue::
 ~TaskQueue()
 {
+    for (TaskNode* block : poolBlocks) delete[] block;
+    delete timers;
     scond_destroy(&not_empty);
     smutex_destroy(&mtx);
 }
 
+/*
+ * ------------------------------------------------------------------
+ * growPool --
+ *
+ *      Allocate another block of poolSize nodes and thread them onto
+ *      the free list. Must be called with mtx held (or from the
+ *      constructor).
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+growPool()
+{
+    TaskNode* block = new TaskNode[poolSize];
+    for (int i = 0; i < poolSize; ++i) {
+        block[i].next = freeNodes;
+        freeNodes = &block[i];
+    }
+    poolBlocks.push_back(block);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * poolBlockCount --
+ *
+ *      Return how many node blocks the pool has allocated. Stays at 1
+ *      as long as the initial pool size covers the queue's peak
+ *      depth.
+ *
+ * Results:
+ *      The number of pool blocks, 0 if not in pool mode.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+poolBlockCount()
+{
+    smutex_lock(&mtx);
+    int n = static_cast<int>(poolBlocks.size());
+    smutex_unlock(&mtx);
+    return n;
+}
+
 /*
  * ------------------------------------------------------------------
  * size --
@@ -30,7 +121,7 @@ int TaskQueue::
 size()
 {
    smutex_lock(&mtx);
-    int n = static_cast<int>(q.size());
+    int n = readyCount.load();
     smutex_unlock(&mtx);
     return n;
 }
@@ -50,11 +141,261 @@ bool TaskQueue::
 empty()
 {
     smutex_lock(&mtx);
-    bool e = q.empty();
+    bool e = readyCount.load() == 0;
     smutex_unlock(&mtx);
     return e;
 }
 
+/*
+ * ------------------------------------------------------------------
+ * enableAdaptiveSpin --
+ *
+ *      Let dequeue spin for up to maxSpins iterations on an empty
+ *      queue before parking. 0 turns spinning off again, and so
+ *      does running on a single CPU.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enableAdaptiveSpin(int maxSpins)
+{
+    // Spinning on a single CPU only delays the producer we wait for.
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) maxSpins = 0;
+
+    smutex_lock(&mtx);
+    spinMax = maxSpins > 0 ? maxSpins : 0;
+    spinLimit.store(spinMax > SPIN_MIN_ITERS ? SPIN_MIN_ITERS : spinMax);
+    smutex_unlock(&mtx);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * getWaitStats --
+ *
+ *      Return a snapshot of the spin/park counters.
+ *
+ * Results:
+ *      The counters.
+ *
+ * ------------------------------------------------------------------
+ */
+TaskQueueWaitStats TaskQueue::
+getWaitStats()
+{
+    smutex_lock(&mtx);
+    TaskQueueWaitStats st = waitStats;
+    st.spinLimit = spinLimit.load();
+    smutex_unlock(&mtx);
+    return st;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * storePush, storePop --
+ *
+ *      Append a task to, or take the first task from, whichever
+ *      storage this queue uses. Must be called with mtx held.
+ *
+ * Results:
+ *      storePop returns false if the queue is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+storePush(Task task)
+{
+    if (poolModeEnabled()) {
+        if (!freeNodes) growPool();
+        TaskNode* n = freeNodes;
+        freeNodes = n->next;
+        n->task = task;
+        n->next = nullptr;
+        if (tail) {
+            tail->next = n;
+        } else {
+            head = n;
+        }
+        tail = n;
+        ++count;
+    } else {
+        q.push_back(task);
+    }
+}
+
+bool TaskQueue::
+storePop(Task* task)
+{
+    if (poolModeEnabled()) {
+        if (count == 0) return false;
+        TaskNode* n = head;
+        head = n->next;
+        if (!head) tail = nullptr;
+        --count;
+        *task = n->task;
+        n->next = freeNodes;
+        freeNodes = n;
+    } else {
+        if (q.empty()) return false;
+        *task = q.front();
+        q.pop_front();
+    }
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * pushLocked, popLocked --
+ *
+ *      storePush/storePop plus upkeep of the lock-free ready count
+ *      that spinning consumers watch. Must be called with mtx held.
+ *
+ * Results:
+ *      popLocked returns false if the queue is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+pushLocked(Task task)
+{
+    storePush(task);
+    readyCount.fetch_add(1, std::memory_order_release);
+}
+
+bool TaskQueue::
+popLocked(Task* task)
+{
+    if (!storePop(task)) return false;
+    readyCount.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * spinForTask --
+ *
+ *      Spin without holding mtx until a task shows up or the spin
+ *      budget runs out. Must be called with mtx released.
+ *
+ * Results:
+ *      The number of iterations spun if a task showed up, -1 if the
+ *      budget ran out.
+ *
+ * ------------------------------------------------------------------
+ */
+int TaskQueue::
+spinForTask()
+{
+    int limit = spinLimit.load(std::memory_order_relaxed);
+    for (int i = 0; i < limit; ++i) {
+        if (readyCount.load(std::memory_order_acquire) > 0) return i;
+        cpu_relax();
+    }
+    return -1;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * fireTimersLocked --
+ *
+ *      Advance the timer wheel to the current time and move every
+ *      task that came due into the ready queue, waking a parked
+ *      consumer for each task beyond the first. Must be called with
+ *      mtx held.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+fireTimersLocked()
+{
+    if (!timers || timers->empty()) return;
+    uint64_t tick = (uint64_t) ((now_sec() - timerEpoch) / TASK_TIMER_TICK_SEC);
+    if (tick <= timers->currentTick()) return;
+
+    dueTasks.clear();
+    timers->advance(tick, &dueTasks);
+    for (size_t i = 0; i < dueTasks.size(); ++i) {
+        pushLocked(dueTasks[i]);
+        // The caller takes one; the rest go to parked consumers.
+        if (i > 0 && sleepers > 0) scond_signal(&not_empty, &mtx);
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * clock --
+ *
+ *      Return the current time on the clock enqueueAt deadlines are
+ *      measured against.
+ *
+ * Results:
+ *      CLOCK_MONOTONIC time in seconds.
+ *
+ * ------------------------------------------------------------------
+ */
+double TaskQueue::
+clock()
+{
+    return now_sec();
+}
+
+/*
+ * ------------------------------------------------------------------
+ * enqueueAt --
+ *
+ *      Make the task available to dequeue once the deadline has
+ *      passed, rounded up to the next timer tick. A deadline in the
+ *      past behaves like enqueue.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TaskQueue::
+enqueueAt(double deadline, Task task)
+{
+    smutex_lock(&mtx);
+    if (!timers) {
+        timers = new TimerWheel();
+        timerEpoch = now_sec();
+    }
+    fireTimersLocked();
+
+    double rel = deadline - timerEpoch;
+    uint64_t tick = rel > 0 ? (uint64_t) ceil(rel / TASK_TIMER_TICK_SEC) : 0;
+    if (tick <= timers->currentTick()) {
+        pushLocked(task);
+        if (sleepers > 0) scond_signal(&not_empty, &mtx);
+        smutex_unlock(&mtx);
+        return;
+    }
+
+    timers->schedule(tick, task);
+    if (sleepers > 0) {
+        if (!timerKeeper) {
+            // Nobody is watching the clock; recruit a parked consumer.
+            scond_signal(&not_empty, &mtx);
+        } else if (tick < keeperWakeup) {
+            // The keeper sleeps past this deadline. We cannot tell
+            // which waiter it is, so wake them all to re-arm.
+            scond_broadcast(&not_empty, &mtx);
+        }
+    }
+    smutex_unlock(&mtx);
+}
+
+void TaskQueue::
+enqueueAfter(double delay, Task task)
+{
+    enqueueAt(now_sec() + delay, task);
+}
+
 /*
  * ------------------------------------------------------------------
  * enqueue --
@@ -70,9 +411,9 @@ void TaskQueue::
 enqueue(Task task)
 {
     smutex_lock(&mtx);
-    q.push_back(task);
-    // Wake one waiter (there is now at least one task)
-    scond_signal(&not_empty, &mtx);
+    pushLocked(task);
+    // Wake one parked waiter (there is now at least one task)
+    if (sleepers > 0) scond_signal(&not_empty, &mtx);
     smutex_unlock(&mtx);
 }
 
@@ -83,6 +424,10 @@ enqueue(Task task)
  *      Remove the Task at the front of the queue and return it.
  *      If the queue is empty, block until a Task is inserted.
  *
+ *      With adaptive spinning enabled, spin briefly before blocking
+ *      and adjust the spin budget by the outcome. Tasks whose
+ *      enqueueAt deadline has passed are moved in first.
+ *
  * Results:
  *      The Task at the front of the queue.
  *
@@ -91,14 +436,65 @@ enqueue(Task task)
 Task TaskQueue::
 dequeue()
 {
+    Task t;
     smutex_lock(&mtx);
-    while (q.empty()) {
+    fireTimersLocked();
+    if (popLocked(&t)) {
+        smutex_unlock(&mtx);
+        return t;
+    }
+    if (spinMax > 0) {
+        smutex_unlock(&mtx);
+        double start = now_sec();
+        int spun = spinForTask();
+        double spent = now_sec() - start;
+        smutex_lock(&mtx);
+
+        int limit = spinLimit.load(std::memory_order_relaxed);
+        waitStats.spinIters += spun >= 0 ? spun : limit;
+        waitStats.spinSeconds += spent;
+        if (spun >= 0 && popLocked(&t)) {
+            // Caught a task: aim for twice the spin length that worked.
+            ++waitStats.spinsWon;
+            int target = 2 * spun + SPIN_MIN_ITERS;
+            limit = (limit + target) / 2 + 1;
+            if (limit > spinMax) limit = spinMax;
+            spinLimit.store(limit, std::memory_order_relaxed);
+            smutex_unlock(&mtx);
+            return t;
+        }
+        ++waitStats.spinsLost;
+        limit /= 2;
+        if (limit < SPIN_MIN_ITERS) limit = SPIN_MIN_ITERS < spinMax ? SPIN_MIN_ITERS : spinMax;
+        spinLimit.store(limit, std::memory_order_relaxed);
+    }
+    for (;;) {
+        fireTimersLocked();
+        if (popLocked(&t)) break;
         // Wait atomically: release mtx and sleep; upon wakeup, re-acquire mtx
-        scond_wait(&not_empty, &mtx);
+        ++sleepers;
+        ++waitStats.parks;
+        if (timers && !timers->empty() && !timerKeeper) {
+            // Become the timer keeper: sleep no later than the next
+            // wheel slot that needs attention.
+            timerKeeper = true;
+            keeperWakeup = timers->nextWakeup();
+            double delay = timerEpoch + keeperWakeup * TASK_TIMER_TICK_SEC - now_sec();
+            if (delay < 0) delay = 0;
+            unsigned int sec = (unsigned int) delay;
+            unsigned int nsec = (unsigned int) ((delay - sec) * 1e9);
+            if (nsec >= 1000000000) nsec = 999999999;
+            scond_timedwait(&not_empty, &mtx, sec, nsec);
+            timerKeeper = false;
+        } else {
+            scond_wait(&not_empty, &mtx);
+        }
+        --sleepers;
+    }
+    // Leaving with timers pending and no keeper: hand the job on.
+    if (timers && !timers->empty() && !timerKeeper && sleepers > 0) {
+        scond_signal(&not_empty, &mtx);
     }
-    Task t = q.front();
-    q.pop_front();
     smutex_unlock(&mtx);
     return t;
 }
-
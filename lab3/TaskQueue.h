@@ -1,8 +1,13 @@
 #pragma once
+#include <atomic>
+#include <stdint.h>
 #include <deque>
+#include <vector>
 
 #include "sthread.h"
 
+class TimerWheel;
+
 typedef void (*handler_t) (void *); 
 
 struct Task {
@@ -10,6 +15,19 @@ struct Task {
     void* arg;
 };
 
+// Resolution of enqueueAt deadlines.
+#define TASK_TIMER_TICK_SEC 0.001
+
+// Counters kept by a TaskQueue with adaptive spinning enabled.
+struct TaskQueueWaitStats {
+    long spinsWon;       // spins that ended with a task
+    long spinsLost;      // spins that gave up and parked
+    long parks;          // scond_wait calls
+    long spinIters;      // total spin iterations
+    double spinSeconds;  // wall time spent spinning
+    int spinLimit;       // current spin budget
+};
+
 /*
  * ------------------------------------------------------------------
  * TaskQueue --
@@ -17,17 +35,83 @@ struct Task {
  *      A thread-safe task queue. This queue should be implemented
  *      as a monitor.
  *
+ *      By default tasks are kept in a std::deque. A queue built with
+ *      a pool size instead keeps them in intrusive nodes carved out
+ *      of a pre-allocated pool and recycled through a free list, so
+ *      enqueue and dequeue never call the allocator once the queue
+ *      is warm. If the pool runs dry it grows by another block of
+ *      the same size.
+ *
+ *      With adaptive spinning enabled, a consumer that finds the
+ *      queue empty first spins for a bounded number of iterations,
+ *      watching a lock-free count of queued tasks, before parking
+ *      on the condition variable. The spin budget tunes itself:
+ *      it tracks the spin length that recently caught a task and
+ *      halves whenever a spin comes up empty. Producers only signal
+ *      when a consumer is actually parked.
+ *
+ *      Tasks enqueued with a deadline wait in a hierarchical timer
+ *      wheel (see TimerWheel.h), created on first use, with a
+ *      TASK_TIMER_TICK_SEC resolution. Consumers move due tasks into
+ *      the ready queue as they pass through dequeue; one parked
+ *      consumer at a time sleeps with a timeout on the next expiry,
+ *      so no thread is dedicated to timers.
+ *
+ *      Subclasses may replace the FIFO order by overriding the
+ *      storePush/storePop hooks; locking, blocking and spinning
+ *      stay here.
+ *
  * ------------------------------------------------------------------
  */
 class TaskQueue {
     private:
+    struct TaskNode {
+        Task task;
+        TaskNode* next;
+    };
+
     std::deque<Task> q;
+
+    // pool mode
+    const int poolSize;
+    std::vector<TaskNode*> poolBlocks;
+    TaskNode* freeNodes;
+    TaskNode* head;
+    TaskNode* tail;
+    int count;
+
+    // adaptive spinning
+    std::atomic<int> readyCount;
+    int sleepers;
+    int spinMax;
+    std::atomic<int> spinLimit;
+    TaskQueueWaitStats waitStats;
+
+    // delayed tasks
+    TimerWheel* timers;
+    double timerEpoch;
+    bool timerKeeper;
+    uint64_t keeperWakeup;
+    std::vector<Task> dueTasks;
+
     int size();
     bool empty();
+    void growPool();
+    void pushLocked(Task task);
+    bool popLocked(Task* task);
+    int spinForTask();
+    void fireTimersLocked();
+
+    protected:
+    // Storage hooks, called with mtx held. Subclasses that order
+    // tasks differently override both.
+    virtual void storePush(Task task);
+    virtual bool storePop(Task* task);
 
     public:
     TaskQueue();
-    ~TaskQueue();
+    explicit TaskQueue(int poolSize);
+    virtual ~TaskQueue();
     
     // no default copy constructor and assignment operators. this will prevent some
     // painful bugs by converting them into compiler errors.
@@ -37,9 +121,22 @@ class TaskQueue {
     void enqueue(Task task);
     Task dequeue();
 
-    private:
+    // deadline is an absolute CLOCK_MONOTONIC time in seconds.
+    void enqueueAt(double deadline, Task task);
+    void enqueueAfter(double delay, Task task);
+    static double clock();
+
+    bool poolModeEnabled() const { return poolSize > 0; }
+    int poolBlockCount();
+
+    void enableAdaptiveSpin(int maxSpins);
+    TaskQueueWaitStats getWaitStats();
+
+    protected:
     
     smutex_t mtx;
+
+    private:
     scond_t not_empty;
     
     
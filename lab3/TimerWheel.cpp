@@ -0,0 +1,188 @@
+#include <cstring>
+
+#include "TimerWheel.h"
+
+#define SLOT_MASK ((uint64_t) TIMER_WHEEL_SLOTS - 1)
+
+static inline int
+slotIndex(uint64_t tick, int level)
+{
+    return (int) ((tick >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK);
+}
+
+TimerWheel::
+TimerWheel()
+    : freeNodes(nullptr), now(0), count(0)
+{
+    memset(slots, 0, sizeof(slots));
+}
+
+TimerWheel::
+~TimerWheel()
+{
+    for (int l = 0; l < TIMER_WHEEL_LEVELS; ++l) {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; ++s) {
+            while (slots[l][s]) {
+                TimerNode* n = slots[l][s];
+                slots[l][s] = n->next;
+                delete n;
+            }
+        }
+    }
+    while (freeNodes) {
+        TimerNode* n = freeNodes;
+        freeNodes = n->next;
+        delete n;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * place --
+ *
+ *      Link a node into the slot matching its distance from now.
+ *      The node must expire after now.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimerWheel::
+place(TimerNode* n)
+{
+    uint64_t delta = n->expires - now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1
+           && delta >= (uint64_t) 1 << ((level + 1) * TIMER_WHEEL_SLOT_BITS))
+        ++level;
+
+    int slot;
+    if (level == TIMER_WHEEL_LEVELS - 1
+        && delta >= (uint64_t) 1 << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) {
+        // Too far out: park in the farthest slot, re-placed on cascade.
+        slot = (slotIndex(now, level) + TIMER_WHEEL_SLOTS - 1) % TIMER_WHEEL_SLOTS;
+    } else {
+        slot = slotIndex(n->expires, level);
+    }
+    n->next = slots[level][slot];
+    slots[level][slot] = n;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * schedule --
+ *
+ *      Schedule a task to become due at tick "expires". A tick at or
+ *      before now is due on the next advance.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimerWheel::
+schedule(uint64_t expires, Task task)
+{
+    TimerNode* n = freeNodes;
+    if (n) {
+        freeNodes = n->next;
+    } else {
+        n = new TimerNode;
+    }
+    n->task = task;
+    n->expires = expires > now ? expires : now + 1;
+    place(n);
+    ++count;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * cascade --
+ *
+ *      Re-place every node of the current slot of "level" into the
+ *      levels below.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimerWheel::
+cascade(int level)
+{
+    int slot = slotIndex(now, level);
+    TimerNode* n = slots[level][slot];
+    slots[level][slot] = nullptr;
+    while (n) {
+        TimerNode* next = n->next;
+        place(n);
+        n = next;
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * advance --
+ *
+ *      Move time forward to "tick", appending the tasks that became
+ *      due to *due in expiry order (ties in any order). An empty
+ *      wheel jumps straight to "tick".
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+void TimerWheel::
+advance(uint64_t tick, std::vector<Task>* due)
+{
+    while (now < tick) {
+        if (count == 0) {
+            now = tick;
+            break;
+        }
+        ++now;
+        // When a level wraps, pull the next slot of the level above
+        // down into it.
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+            if (slotIndex(now, level - 1) != 0) break;
+            cascade(level);
+        }
+
+        int slot = slotIndex(now, 0);
+        TimerNode* n = slots[0][slot];
+        slots[0][slot] = nullptr;
+        while (n) {
+            TimerNode* next = n->next;
+            due->push_back(n->task);
+            n->next = freeNodes;
+            freeNodes = n;
+            --count;
+            n = next;
+        }
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * nextWakeup --
+ *
+ *      Return the next tick worth advancing to: the next non-empty
+ *      level 0 slot of the current rotation, or else the start of
+ *      the next rotation, where higher levels cascade down.
+ *
+ * Results:
+ *      A tick after now. Meaningless if the wheel is empty.
+ *
+ * ------------------------------------------------------------------
+ */
+uint64_t TimerWheel::
+nextWakeup() const
+{
+    int cur = slotIndex(now, 0);
+    for (int s = cur + 1; s < TIMER_WHEEL_SLOTS; ++s) {
+        if (slots[0][s]) return now + (s - cur);
+    }
+    return now + (TIMER_WHEEL_SLOTS - cur);
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#include "TaskQueue.h"
+
+#define TIMER_WHEEL_LEVELS     4
+#define TIMER_WHEEL_SLOT_BITS  6
+#define TIMER_WHEEL_SLOTS      (1 << TIMER_WHEEL_SLOT_BITS)
+
+/*
+ * ------------------------------------------------------------------
+ * TimerWheel --
+ *
+ *      A hierarchical timing wheel of delayed Tasks, in integer
+ *      ticks. Level 0 has one slot per tick for the next 64 ticks.
+ *      Each higher level has slots 64 times coarser. Scheduling a
+ *      task is O(1): it goes into the slot of the lowest level
+ *      whose span covers its delay. As time advances, a higher
+ *      level slot is cascaded into the levels below when the level
+ *      below wraps around, so every task is moved at most
+ *      TIMER_WHEEL_LEVELS times before it fires. Delays beyond the
+ *      top level's span are parked in its farthest slot and
+ *      re-cascaded.
+ *
+ *      Not thread-safe: the owner serializes all calls.
+ *
+ * ------------------------------------------------------------------
+ */
+class TimerWheel {
+    private:
+    struct TimerNode {
+        Task task;
+        uint64_t expires;
+        TimerNode* next;
+    };
+
+    TimerNode* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    TimerNode* freeNodes;
+    uint64_t now;
+    int count;
+
+    void place(TimerNode* n);
+    void cascade(int level);
+
+    public:
+    TimerWheel();
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel &) = delete;
+
+    bool empty() const { return count == 0; }
+    uint64_t currentTick() const { return now; }
+
+    void schedule(uint64_t expires, Task task);
+    void advance(uint64_t tick, std::vector<Task>* due);
+    uint64_t nextWakeup() const;
+};
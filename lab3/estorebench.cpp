@@ -0,0 +1,788 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <atomic>
+#include <new>
+#include <vector>
+
+#include "EStore.h"
+#include "TaskQueue.h"
+#include "FairTaskQueue.h"
+#include "MutationLog.h"
+#include "sthread.h"
+
+/*
+ * estorebench --
+ *
+ *      Micro-benchmarks for the estore building blocks. Each mode
+ *      prints one line per configuration.
+ *
+ *          estorebench queue [tasks]
+ *          estorebench spin [tasks]
+ *          estorebench fair [tasks]
+ *          estorebench timer [tasks]
+ *          estorebench watch [watches]
+ *          estorebench replay [records]
+ *          estorebench hot [seconds]
+ */
+
+// Every operator new/delete in this binary goes through these
+// counters, which is how the benchmarks report allocator traffic.
+static std::atomic<long> numAllocs(0);
+static std::atomic<long> numFrees(0);
+
+void* operator new(size_t sz)
+{
+    numAllocs.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(sz ? sz : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if (!p) return;
+    numFrees.fetch_add(1, std::memory_order_relaxed);
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+static double
+now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+noop_handler(void* arg)
+{
+    (void)arg;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * queue benchmark --
+ *
+ *      QUEUE_PRODUCERS threads each enqueue "tasks" no-op tasks in
+ *      bursts while QUEUE_CONSUMERS threads drain them. Consumers
+ *      stop on a task with a null handler. One warm-up round runs
+ *      first so only steady-state allocations are counted.
+ *
+ * ------------------------------------------------------------------
+ */
+#define QUEUE_PRODUCERS 4
+#define QUEUE_CONSUMERS 4
+#define QUEUE_BURST     256
+
+struct QueueBench {
+    TaskQueue* queue;
+    int tasks;
+};
+
+static void*
+queueProducer(void* arg)
+{
+    QueueBench* b = static_cast<QueueBench*>(arg);
+    Task t;
+    t.handler = noop_handler;
+    t.arg = nullptr;
+    for (int i = 0; i < b->tasks; ++i) {
+        b->queue->enqueue(t);
+        if (i % QUEUE_BURST == QUEUE_BURST - 1) sthread_sleep(0, 10000);
+    }
+    return nullptr;
+}
+
+static void*
+queueConsumer(void* arg)
+{
+    QueueBench* b = static_cast<QueueBench*>(arg);
+    for (;;) {
+        Task t = b->queue->dequeue();
+        if (!t.handler) break;
+        t.handler(t.arg);
+    }
+    return nullptr;
+}
+
+static double
+runQueueRound(QueueBench* b)
+{
+    sthread_t producers[QUEUE_PRODUCERS], consumers[QUEUE_CONSUMERS];
+    double start = now_sec();
+    for (int i = 0; i < QUEUE_CONSUMERS; ++i)
+        sthread_create(&consumers[i], queueConsumer, b);
+    for (int i = 0; i < QUEUE_PRODUCERS; ++i)
+        sthread_create(&producers[i], queueProducer, b);
+    for (int i = 0; i < QUEUE_PRODUCERS; ++i)
+        sthread_join(producers[i]);
+
+    Task stop;
+    stop.handler = nullptr;
+    stop.arg = nullptr;
+    for (int i = 0; i < QUEUE_CONSUMERS; ++i)
+        b->queue->enqueue(stop);
+    for (int i = 0; i < QUEUE_CONSUMERS; ++i)
+        sthread_join(consumers[i]);
+    return now_sec() - start;
+}
+
+static void
+benchQueue(const char* name, TaskQueue* queue, int tasks)
+{
+    QueueBench b;
+    b.queue = queue;
+    b.tasks = tasks;
+
+    runQueueRound(&b);          // warm-up
+
+    long allocs = numAllocs.load(), frees = numFrees.load();
+    double secs = runQueueRound(&b);
+    allocs = numAllocs.load() - allocs;
+    frees = numFrees.load() - frees;
+
+    long ops = (long) QUEUE_PRODUCERS * tasks;
+    printf("%-8s %10.0f tasks/s  mallocs %8ld  frees %8ld\n",
+           name, ops / secs, allocs, frees);
+}
+
+static void
+queueMain(int tasks)
+{
+    // sthread_create/join allocate nothing through operator new, so
+    // any count below comes from the queue itself.
+    TaskQueue dequeQueue;
+    benchQueue("deque", &dequeQueue, tasks);
+
+    TaskQueue poolQueue(QUEUE_PRODUCERS * tasks + QUEUE_CONSUMERS);
+    benchQueue("pool", &poolQueue, tasks);
+    printf("pool blocks: %d\n", poolQueue.poolBlockCount());
+}
+
+/*
+ * ------------------------------------------------------------------
+ * spin benchmark --
+ *
+ *      One producer enqueues "tasks" tasks, busy-waiting SPIN_GAP_US
+ *      between them, to SPIN_CONSUMERS consumers. Each task carries
+ *      its enqueue time, so consumers measure enqueue-to-dequeue
+ *      latency. Run once parking right away and once with adaptive
+ *      spinning, and report latency next to the CPU time burned.
+ *
+ * ------------------------------------------------------------------
+ */
+#define SPIN_CONSUMERS 2
+#define SPIN_GAP_US    5
+#define SPIN_MAX_ITERS 20000
+
+struct SpinBench {
+    TaskQueue* queue;
+    int tasks;
+    std::vector<double> enqueuedAt;
+    double latency[SPIN_CONSUMERS];
+    long dequeued[SPIN_CONSUMERS];
+};
+
+struct SpinConsumerArg {
+    SpinBench* bench;
+    int id;
+};
+
+static double
+cpu_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void*
+spinConsumer(void* arg)
+{
+    SpinConsumerArg* c = static_cast<SpinConsumerArg*>(arg);
+    SpinBench* b = c->bench;
+    for (;;) {
+        Task t = b->queue->dequeue();
+        if (!t.handler) break;
+        b->latency[c->id] += now_sec() - *static_cast<double*>(t.arg);
+        b->dequeued[c->id]++;
+    }
+    return nullptr;
+}
+
+static void
+benchSpin(const char* name, int maxSpins, int tasks)
+{
+    TaskQueue queue(1024);
+    queue.enableAdaptiveSpin(maxSpins);
+
+    SpinBench b;
+    b.queue = &queue;
+    b.tasks = tasks;
+    b.enqueuedAt.resize(tasks);
+    SpinConsumerArg args[SPIN_CONSUMERS];
+    sthread_t consumers[SPIN_CONSUMERS];
+
+    double wall = now_sec(), cpu = cpu_sec();
+    for (int i = 0; i < SPIN_CONSUMERS; ++i) {
+        b.latency[i] = 0;
+        b.dequeued[i] = 0;
+        args[i].bench = &b;
+        args[i].id = i;
+        sthread_create(&consumers[i], spinConsumer, &args[i]);
+    }
+
+    for (int i = 0; i < tasks; ++i) {
+        double until = now_sec() + SPIN_GAP_US / 1e6;
+        while (now_sec() < until) { }
+        Task t;
+        t.handler = noop_handler;
+        t.arg = &b.enqueuedAt[i];
+        b.enqueuedAt[i] = now_sec();
+        queue.enqueue(t);
+    }
+    Task stop;
+    stop.handler = nullptr;
+    stop.arg = nullptr;
+    for (int i = 0; i < SPIN_CONSUMERS; ++i) queue.enqueue(stop);
+    for (int i = 0; i < SPIN_CONSUMERS; ++i) sthread_join(consumers[i]);
+    wall = now_sec() - wall;
+    cpu = cpu_sec() - cpu;
+
+    double latency = 0;
+    long n = 0;
+    for (int i = 0; i < SPIN_CONSUMERS; ++i) {
+        latency += b.latency[i];
+        n += b.dequeued[i];
+    }
+    TaskQueueWaitStats st = queue.getWaitStats();
+    printf("%-6s latency %7.2f us  cpu %5.2fs / wall %5.2fs  "
+           "spinning %5.2fs  won %ld lost %ld parks %ld  limit %d\n",
+           name, latency / n * 1e6, cpu, wall, st.spinSeconds,
+           st.spinsWon, st.spinsLost, st.parks, st.spinLimit);
+}
+
+static void
+spinMain(int tasks)
+{
+    benchSpin("park", 0, tasks);
+    benchSpin("spin", SPIN_MAX_ITERS, tasks);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * fair benchmark --
+ *
+ *      A backlog of slow requests (FAIR_SLOW_US of work each) with
+ *      one cheap request mixed in per FAIR_MIX slow ones, served by
+ *      FAIR_WORKERS threads. Compare the per-type queueing delay of
+ *      a plain FIFO TaskQueue against a FairTaskQueue.
+ *
+ * ------------------------------------------------------------------
+ */
+#define FAIR_WORKERS 2
+#define FAIR_SLOW_US 100
+#define FAIR_MIX     10
+
+static void
+slow_handler(void* arg)
+{
+    (void)arg;
+    double until = now_sec() + FAIR_SLOW_US / 1e6;
+    while (now_sec() < until) { }
+}
+
+static void
+cheap_handler(void* arg)
+{
+    (void)arg;
+}
+
+struct FairBench {
+    TaskQueue* queue;
+    std::vector<double> enqueuedAt;
+    double wait[FAIR_WORKERS][2];
+    long count[FAIR_WORKERS][2];
+};
+
+struct FairWorkerArg {
+    FairBench* bench;
+    int id;
+};
+
+static void*
+fairWorker(void* arg)
+{
+    FairWorkerArg* w = static_cast<FairWorkerArg*>(arg);
+    FairBench* b = w->bench;
+    for (;;) {
+        Task t = b->queue->dequeue();
+        if (t.handler == noop_handler) break;
+        int type = t.handler == cheap_handler;
+        b->wait[w->id][type] += now_sec() - *static_cast<double*>(t.arg);
+        b->count[w->id][type]++;
+        t.handler(t.arg);
+    }
+    return nullptr;
+}
+
+static void
+benchFair(const char* name, TaskQueue* queue, int tasks)
+{
+    FairBench b;
+    b.queue = queue;
+    b.enqueuedAt.resize(tasks);
+    FairWorkerArg args[FAIR_WORKERS];
+    sthread_t workers[FAIR_WORKERS];
+
+    // Queue the whole backlog before the workers start.
+    for (int i = 0; i < tasks; ++i) {
+        Task t;
+        t.handler = i % (FAIR_MIX + 1) == FAIR_MIX ? cheap_handler : slow_handler;
+        t.arg = &b.enqueuedAt[i];
+        b.enqueuedAt[i] = now_sec();
+        queue->enqueue(t);
+    }
+    Task stop;
+    stop.handler = noop_handler;
+    stop.arg = nullptr;
+    for (int i = 0; i < FAIR_WORKERS; ++i) queue->enqueue(stop);
+
+    for (int i = 0; i < FAIR_WORKERS; ++i) {
+        b.wait[i][0] = b.wait[i][1] = 0;
+        b.count[i][0] = b.count[i][1] = 0;
+        args[i].bench = &b;
+        args[i].id = i;
+        sthread_create(&workers[i], fairWorker, &args[i]);
+    }
+    for (int i = 0; i < FAIR_WORKERS; ++i) sthread_join(workers[i]);
+
+    for (int type = 0; type < 2; ++type) {
+        double wait = 0;
+        long n = 0;
+        for (int i = 0; i < FAIR_WORKERS; ++i) {
+            wait += b.wait[i][type];
+            n += b.count[i][type];
+        }
+        printf("%-5s %-5s  %6ld tasks  mean wait %8.2f ms\n",
+               name, type ? "cheap" : "slow", n, n ? wait / n * 1e3 : 0.0);
+    }
+}
+
+static void
+fairMain(int tasks)
+{
+    TaskQueue fifo;
+    benchFair("fifo", &fifo, tasks);
+
+    FairTaskQueue fair;
+    fair.setWeight(slow_handler, 1);
+    fair.setWeight(cheap_handler, 1);
+    fair.setWeight(noop_handler, 0);
+    benchFair("drr", &fair, tasks);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * timer --
+ *
+ *      Cost of scheduling delayed tasks with enqueueAt at growing
+ *      numbers of pending timers, then how late due tasks reach two
+ *      workers that only call dequeue.
+ *
+ * ------------------------------------------------------------------
+ */
+#define TIMER_WORKERS   2
+#define TIMER_SPREAD_MS 200
+
+struct TimerBench {
+    TaskQueue* queue;
+    double late[TIMER_WORKERS];
+    double maxLate[TIMER_WORKERS];
+    long count[TIMER_WORKERS];
+};
+
+struct TimerWorkerArg {
+    TimerBench* bench;
+    int id;
+};
+
+static void*
+timerWorker(void* arg)
+{
+    TimerWorkerArg* w = static_cast<TimerWorkerArg*>(arg);
+    TimerBench* b = w->bench;
+    for (;;) {
+        Task t = b->queue->dequeue();
+        if (t.handler == noop_handler) break;
+        double late = now_sec() - *static_cast<double*>(t.arg);
+        b->late[w->id] += late;
+        if (late > b->maxLate[w->id]) b->maxLate[w->id] = late;
+        b->count[w->id]++;
+    }
+    return nullptr;
+}
+
+static void
+timerMain(int tasks)
+{
+    // Schedule cost: far-off deadlines so nothing fires meanwhile.
+    for (int pending = tasks / 100; pending <= tasks; pending *= 10) {
+        TaskQueue queue;
+        Task t;
+        t.handler = cheap_handler;
+        t.arg = nullptr;
+        double base = TaskQueue::clock() + 3600;
+        long allocs = numAllocs.load();
+        double start = now_sec();
+        for (int i = 0; i < pending; ++i) {
+            queue.enqueueAt(base + (sutil_random() % 100000) / 1e3, t);
+        }
+        double secs = now_sec() - start;
+        printf("schedule  %8d pending  %7.1f ns/op  %8ld allocs\n",
+               pending, secs / pending * 1e9, numAllocs.load() - allocs);
+    }
+
+    // Firing: deadlines spread over TIMER_SPREAD_MS.
+    TaskQueue queue;
+    TimerBench b;
+    TimerWorkerArg args[TIMER_WORKERS];
+    sthread_t workers[TIMER_WORKERS];
+    std::vector<double> deadlines(tasks);
+    b.queue = &queue;
+    for (int i = 0; i < TIMER_WORKERS; ++i) {
+        b.late[i] = b.maxLate[i] = 0;
+        b.count[i] = 0;
+        args[i].bench = &b;
+        args[i].id = i;
+        sthread_create(&workers[i], timerWorker, &args[i]);
+    }
+    double base = TaskQueue::clock();
+    for (int i = 0; i < tasks; ++i) {
+        Task t;
+        t.handler = cheap_handler;
+        t.arg = &deadlines[i];
+        deadlines[i] = base + (sutil_random() % (TIMER_SPREAD_MS * 1000)) / 1e6;
+        queue.enqueueAt(deadlines[i], t);
+    }
+    Task stop;
+    stop.handler = noop_handler;
+    stop.arg = nullptr;
+    for (int i = 0; i < TIMER_WORKERS; ++i) {
+        queue.enqueueAt(base + TIMER_SPREAD_MS / 1e3 + 0.05, stop);
+    }
+    for (int i = 0; i < TIMER_WORKERS; ++i) sthread_join(workers[i]);
+
+    double late = 0, maxLate = 0;
+    long n = 0;
+    for (int i = 0; i < TIMER_WORKERS; ++i) {
+        late += b.late[i];
+        n += b.count[i];
+        if (b.maxLate[i] > maxLate) maxLate = b.maxLate[i];
+    }
+    printf("fire      %8ld tasks    mean late %6.2f ms  max late %6.2f ms\n",
+           n, n ? late / n * 1e3 : 0.0, maxLate * 1e3);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * watch --
+ *
+ *      Cost of priceItem in a fine-mode store with no watches and
+ *      with many watches that do not fire, then the cost of a price
+ *      walk that fires every watch on one item.
+ *
+ * ------------------------------------------------------------------
+ */
+#define WATCH_PRICE   1000.0
+#define WATCH_UPDATES 200000
+
+static void
+watch_handler(void* arg)
+{
+    static_cast<std::atomic<long>*>(arg)->fetch_add(1, std::memory_order_relaxed);
+}
+
+static double
+benchPriceUpdates(EStore* store)
+{
+    double start = now_sec();
+    for (int i = 0; i < WATCH_UPDATES; ++i) {
+        // Every other update is a decrease, which evaluates watches.
+        store->priceItem(i % INVENTORY_SIZE, i & 1 ? WATCH_PRICE : WATCH_PRICE - 1);
+    }
+    return (now_sec() - start) / WATCH_UPDATES;
+}
+
+static void
+watchMain(int numWatches)
+{
+    EStore store(true);
+    store.setShippingCost(0);
+    for (int i = 0; i < INVENTORY_SIZE; ++i) store.addItem(i, 1, WATCH_PRICE, 0);
+
+    printf("priceItem     0 watches  %7.1f ns/op\n", benchPriceUpdates(&store) * 1e9);
+
+    std::atomic<long> fired(0);
+    Task t;
+    t.handler = watch_handler;
+    t.arg = &fired;
+    // Thresholds stay below the cost of any update in the loop above.
+    double start = now_sec();
+    for (int i = 0; i < numWatches; ++i) {
+        store.watch(i % INVENTORY_SIZE, (sutil_random() % 500000) / 1e3, t);
+    }
+    double secs = now_sec() - start;
+    printf("watch     %9d watches  %7.1f ns/op\n", numWatches, secs / numWatches * 1e9);
+
+    printf("priceItem %9d watches  %7.1f ns/op  fired %ld\n",
+           numWatches, benchPriceUpdates(&store) * 1e9, fired.load());
+
+    // Walk item 0 down to free; every watch on it fires once.
+    start = now_sec();
+    for (int p = 500; p >= 0; p -= 10) store.priceItem(0, p);
+    secs = now_sec() - start;
+    long expected = numWatches / INVENTORY_SIZE + (numWatches % INVENTORY_SIZE > 0);
+    printf("price walk  %7ld fired (expected %ld)  %7.1f ns/fired\n",
+           fired.load(), expected, fired.load() ? secs / fired.load() * 1e9 : 0.0);
+}
+
+/*
+ * ------------------------------------------------------------------
+ * replay --
+ *
+ *      First check that replaying the mutation log of a store driven
+ *      by several threads rebuilds the store's state. Then time
+ *      sequential and parallel replay of a large synthetic log, read
+ *      back from a file, per GB of log.
+ *
+ * ------------------------------------------------------------------
+ */
+#define REPLAY_LIVE_THREADS 4
+#define REPLAY_LIVE_OPS     50000
+#define REPLAY_LOG_PATH     "/tmp/estorebench-mutations.log"
+
+static void*
+replayLiveWorker(void* arg)
+{
+    EStore* store = static_cast<EStore*>(arg);
+    for (int i = 0; i < REPLAY_LIVE_OPS; ++i) {
+        int item = sutil_random() % INVENTORY_SIZE;
+        switch (sutil_random() % 9) {
+        case 0: store->addItem(item, sutil_random() % 10, sutil_random() % 100, 0.1); break;
+        case 1: store->removeItem(item); break;
+        case 2: store->addStock(item, sutil_random() % 5); break;
+        case 3: store->priceItem(item, sutil_random() % 100); break;
+        case 4: store->discountItem(item, (sutil_random() % 50) / 100.0); break;
+        case 5: store->setShippingCost(sutil_random() % 10); break;
+        case 6: store->setStoreDiscount((sutil_random() % 50) / 100.0); break;
+        default: {
+            std::vector<int> ids;
+            for (int k = 0; k < 3; ++k) ids.push_back(sutil_random() % INVENTORY_SIZE);
+            store->buyManyItems(&ids, 1000);
+        }
+        }
+    }
+    return nullptr;
+}
+
+static void
+fillSyntheticLog(MutationLog* log, long records)
+{
+    uint64_t x = 88172645463325252ULL;
+    for (long i = 0; i < records; ++i) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        MutationRecord r;
+        r.item_id = (int) ((x >> 8) % INVENTORY_SIZE);
+        r.quantity = (int) ((x >> 20) % 8);
+        r.pad = 0;
+        r.value = (double) ((x >> 32) % 1000);
+        r.value2 = 0.1;
+        int roll = (int) (x % 100);
+        // Mostly purchases and restocks, with a few global changes.
+        if (roll < 50) r.type = MUT_TAKE_STOCK;
+        else if (roll < 75) r.type = MUT_ADD_STOCK;
+        else if (roll < 85) r.type = MUT_PRICE_ITEM;
+        else if (roll < 93) r.type = MUT_DISCOUNT_ITEM;
+        else if (roll < 95) r.type = MUT_ADD_ITEM;
+        else if (roll < 97) r.type = MUT_REMOVE_ITEM;
+        else if (roll < 99) { r.type = MUT_SET_SHIPPING_COST; r.item_id = -1; }
+        else { r.type = MUT_SET_STORE_DISCOUNT; r.item_id = -1; r.value /= 1000; }
+        log->append(r);
+    }
+}
+
+static void
+replayMain(long records)
+{
+    int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+
+    {
+        MutationLog log;
+        EStore store(true);
+        store.setMutationLog(&log);
+        sthread_t workers[REPLAY_LIVE_THREADS];
+        for (int i = 0; i < REPLAY_LIVE_THREADS; ++i) {
+            sthread_create(&workers[i], replayLiveWorker, &store);
+        }
+        for (int i = 0; i < REPLAY_LIVE_THREADS; ++i) sthread_join(workers[i]);
+        log.flush();
+
+        StoreImage live, seq, par;
+        store.snapshot(&live);
+        replaySequential(log, &seq);
+        replayParallel(log, &par, 4);
+        printf("live      %9ld records  sequential %s  parallel %s\n", log.size(),
+               seq == live ? "match" : "DIFFER", par == live ? "match" : "DIFFER");
+    }
+
+    MutationLog log;
+    fillSyntheticLog(&log, records);
+    double gb = (double) records * sizeof(MutationRecord) / 1e9;
+    if (!log.writeFile(REPLAY_LOG_PATH)) {
+        perror(REPLAY_LOG_PATH);
+        return;
+    }
+    double start = now_sec();
+    bool ok = log.readFile(REPLAY_LOG_PATH);
+    double readSecs = now_sec() - start;
+    unlink(REPLAY_LOG_PATH);
+    if (!ok || log.size() != records) {
+        fprintf(stderr, "replay: reading the log back failed\n");
+        return;
+    }
+    printf("read      %9ld records  %6.3f GB  %7.3f s/GB\n", records, gb, readSecs / gb);
+
+    StoreImage seq;
+    start = now_sec();
+    replaySequential(log, &seq);
+    double seqSecs = now_sec() - start;
+    printf("sequential   1 threads  %7.3f s/GB\n", seqSecs / gb);
+
+    for (int threads = 2; threads <= (cpus > 2 ? cpus : 2); threads *= 2) {
+        StoreImage par;
+        start = now_sec();
+        replayParallel(log, &par, threads);
+        double parSecs = now_sec() - start;
+        printf("parallel   %3d threads  %7.3f s/GB  %5.2fx  %s\n", threads, parSecs / gb,
+               seqSecs / parSecs, par == seq ? "match" : "DIFFER");
+    }
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hot --
+ *
+ *      Worker threads hammer a fine-mode store whose items share a
+ *      handful of lock stripes. Most operations go to one hot item,
+ *      which changes half way through. Prints throughput per window
+ *      next to the lock migrations the store made.
+ *
+ * ------------------------------------------------------------------
+ */
+#define HOT_THREADS     4
+#define HOT_STRIPES     8
+#define HOT_WINDOW_SEC  0.1
+#define HOT_SHARE       70     // percent of operations on the hot item
+
+struct HotBench {
+    EStore* store;
+    std::atomic<int> hotItem;
+    std::atomic<bool> stop;
+    std::atomic<long> ops;
+};
+
+static void*
+hotWorker(void* arg)
+{
+    HotBench* b = static_cast<HotBench*>(arg);
+    uint64_t x = 0x9E3779B97F4A7C15ULL ^ (uint64_t) (uintptr_t) &x;
+    long done = 0;
+    while (!b->stop.load(std::memory_order_relaxed)) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        int item = (int) (x % 100) < HOT_SHARE
+                   ? b->hotItem.load(std::memory_order_relaxed)
+                   : (int) ((x >> 8) % INVENTORY_SIZE);
+        if (x & 0x10000) {
+            b->store->addStock(item, 1);
+        } else {
+            b->store->getItemQuantity(item);
+        }
+        if (++done % 1024 == 0) b->ops.fetch_add(1024, std::memory_order_relaxed);
+    }
+    return nullptr;
+}
+
+static void
+hotMain(double seconds)
+{
+    LockStripes stripes(HOT_STRIPES);
+    EStore store(true, &stripes, 0);
+    for (int i = 0; i < INVENTORY_SIZE; ++i) store.addItem(i, 0, 10, 0);
+
+    HotBench b;
+    b.store = &store;
+    b.hotItem.store(7);
+    b.stop.store(false);
+    b.ops.store(0);
+
+    sthread_t workers[HOT_THREADS];
+    for (int i = 0; i < HOT_THREADS; ++i) sthread_create(&workers[i], hotWorker, &b);
+
+    double start = now_sec();
+    long lastOps = 0;
+    size_t shown = 0;
+    for (double t = HOT_WINDOW_SEC; t <= seconds + 1e-9; t += HOT_WINDOW_SEC) {
+        if (t > seconds / 2 && b.hotItem.load() == 7) b.hotItem.store(42);
+        double until = start + t;
+        while (now_sec() < until) sthread_sleep(0, 1000000);
+        long ops = b.ops.load();
+        printf("%6.2f s  hot item %2d  %8.0f ops/s\n",
+               t, b.hotItem.load(), (ops - lastOps) / HOT_WINDOW_SEC);
+        lastOps = ops;
+
+        std::vector<LockMigration> migs = store.getLockMigrations();
+        for (; shown < migs.size(); ++shown) {
+            const LockMigration& m = migs[shown];
+            printf("          migration at %.3f s: item %d %s (%ld contended acquires)\n",
+                   m.when - start, m.item_id,
+                   m.promoted ? "-> dedicated slot" : "-> home stripe", m.contended);
+        }
+    }
+    b.stop.store(true);
+    for (int i = 0; i < HOT_THREADS; ++i) sthread_join(workers[i]);
+}
+
+int main(int argc, char **argv)
+{
+    const char* mode = argc > 1 ? argv[1] : "queue";
+
+    if (strcmp(mode, "queue") == 0) {
+        queueMain(argc > 2 ? atoi(argv[2]) : 200000);
+    } else if (strcmp(mode, "spin") == 0) {
+        spinMain(argc > 2 ? atoi(argv[2]) : 100000);
+    } else if (strcmp(mode, "fair") == 0) {
+        fairMain(argc > 2 ? atoi(argv[2]) : 5500);
+    } else if (strcmp(mode, "timer") == 0) {
+        timerMain(argc > 2 ? atoi(argv[2]) : 100000);
+    } else if (strcmp(mode, "watch") == 0) {
+        watchMain(argc > 2 ? atoi(argv[2]) : 1000000);
+    } else if (strcmp(mode, "replay") == 0) {
+        replayMain(argc > 2 ? atol(argv[2]) : 8000000);
+    } else if (strcmp(mode, "hot") == 0) {
+        hotMain(argc > 2 ? atof(argv[2]) : 2.0);
+    } else {
+        fprintf(stderr, "usage: %s queue|spin|fair|timer|watch|replay|hot [tasks]\n", argv[0]);
+        return 1;
+    }
+    return 0;
+}
@@ -6,9 +6,11 @@
 
 #include "EStore.h"
 #include "TaskQueue.h"
+#include "FairTaskQueue.h"
 #include "sthread.h"
 #include "RequestGenerator.h"
 #include "RequestHandlers.h"  
+#include "StoreHost.h"
 
 class Simulation {
     public:
@@ -16,11 +18,58 @@ class Simulation {
     TaskQueue customerTasks;
     EStore store;
 
+    // fair mode: one queue with a lane per request type, served by
+    // all worker threads
+    FairTaskQueue fairTasks;
+    bool fair;
+
     int maxTasks;
     int numSuppliers;
     int numCustomers;
 
-    explicit Simulation(bool useFineMode) : store(useFineMode) { }
+    explicit Simulation(bool useFineMode) : store(useFineMode), fair(false) { }
+
+    TaskQueue* supplierQueue() { return fair ? &fairTasks : &supplierTasks; }
+    TaskQueue* customerQueue() { return fair ? &fairTasks : &customerTasks; }
+};
+
+// Request type names accepted by --weight, and the handler that
+// identifies each type in a FairTaskQueue.
+static const struct {
+    const char* name;
+    handler_t handler;
+} requestTypes[] = {
+    { "add_item",             add_item_handler },
+    { "remove_item",          remove_item_handler },
+    { "add_stock",            add_stock_handler },
+    { "change_item_price",    change_item_price_handler },
+    { "change_item_discount", change_item_discount_handler },
+    { "set_shipping_cost",    set_shipping_cost_handler },
+    { "set_store_discount",   set_store_discount_handler },
+    { "buy_item",             buy_item_handler },
+    { "buy_many_items",       buy_many_items_handler },
+    { "stop",                 stop_handler },
+};
+#define NUM_REQUEST_TYPES (int) (sizeof(requestTypes) / sizeof(requestTypes[0]))
+
+static const char*
+requestTypeName(handler_t handler)
+{
+    for (int i = 0; i < NUM_REQUEST_TYPES; ++i) {
+        if (requestTypes[i].handler == handler) return requestTypes[i].name;
+    }
+    return "?";
+}
+
+class HostedSimulation {
+    public:
+    StoreHost host;
+
+    int maxTasks;
+    int numWorkers;
+
+    HostedSimulation(int numTenants, int numStripes)
+        : host(numTenants, numStripes) { }
 };
 
 /*
@@ -54,7 +103,7 @@ supplierGenerator(void* arg)
 {
    Simulation* sim = static_cast<Simulation*>(arg);
 
-    SupplierRequestGenerator gen(&sim->supplierTasks);
+    SupplierRequestGenerator gen(sim->supplierQueue());
     gen.enqueueTasks(sim->maxTasks, &sim->store);   // produce supplier tasks
     gen.enqueueStops(sim->numSuppliers);            // one stop per supplier worker
 
@@ -91,7 +140,7 @@ customerGenerator(void* arg)
 {
     Simulation* sim = static_cast<Simulation*>(arg);
 
-    CustomerRequestGenerator gen(&sim->customerTasks, sim->store.fineModeEnabled());
+    CustomerRequestGenerator gen(sim->customerQueue(), sim->store.fineModeEnabled());
     gen.enqueueTasks(sim->maxTasks, &sim->store);   // produce customer tasks
     gen.enqueueStops(sim->numCustomers);            // one stop per customer worker
 
@@ -118,7 +167,7 @@ supplier(void* arg)
     Simulation* sim = static_cast<Simulation*>(arg);
 
     for (;;) {
-        Task t = sim->supplierTasks.dequeue();
+        Task t = sim->supplierQueue()->dequeue();
         if (t.handler == stop_handler) {      // ← explicit stop
             sthread_exit();
         }
@@ -147,7 +196,7 @@ customer(void* arg)
     Simulation* sim = static_cast<Simulation*>(arg);
 
     for (;;) {
-        Task t = sim->customerTasks.dequeue();
+        Task t = sim->customerQueue()->dequeue();
         if (t.handler == stop_handler) {      // ← explicit stop
             sthread_exit();
         }
@@ -180,13 +229,20 @@ customer(void* arg)
  * ------------------------------------------------------------------
  */
 static void
-startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode)
+startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMode,
+                const int* fairWeights)
 {
     Simulation* sim = new Simulation(useFineMode);
     sim->numSuppliers = numSuppliers;
     sim->numCustomers = numCustomers;
     sim->maxTasks     = maxTasks;
 
+    if (fairWeights) {
+        sim->fair = true;
+        for (int i = 0; i < NUM_REQUEST_TYPES; ++i)
+            sim->fairTasks.setWeight(requestTypes[i].handler, fairWeights[i]);
+    }
+
     sthread_t genSupTid, genCusTid;
     std::vector<sthread_t> supTids(numSuppliers);
     std::vector<sthread_t> cusTids(numCustomers);
@@ -215,6 +271,119 @@ startSimulation(int numSuppliers, int numCustomers, int maxTasks, bool useFineMo
         sthread_join(cusTids[i]);
     }
 
+    if (sim->fair) {
+        printf("%-22s %6s %10s %12s %12s\n",
+               "request type", "weight", "dispatched", "mean wait", "max wait");
+        for (const FairTaskQueueTypeStats& st : sim->fairTasks.getTypeStats()) {
+            printf("%-22s %6d %10ld %10.3fms %10.3fms\n",
+                   requestTypeName(st.handler), st.weight, st.dispatched,
+                   st.dispatched ? st.totalWait / st.dispatched * 1e3 : 0.0,
+                   st.maxWait * 1e3);
+        }
+    }
+
+    delete sim;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hostedGenerator --
+ *
+ *      The request generator thread of the multi-tenant simulation.
+ *      The argument is a pointer to the shared HostedSimulation.
+ *
+ *      Submit arg->maxTasks supplier requests and arg->maxTasks
+ *      customer requests, each against a randomly chosen tenant,
+ *      then stop all arg->numWorkers workers.
+ *
+ * Results:
+ *      Does not return. Exit instead.
+ *
+ * ------------------------------------------------------------------
+ */
+static void*
+hostedGenerator(void* arg)
+{
+    HostedSimulation* sim = static_cast<HostedSimulation*>(arg);
+    StoreHost& host = sim->host;
+
+    SupplierRequestGenerator supplierGen(nullptr);
+    CustomerRequestGenerator customerGen(nullptr, true);
+    for (int i = 0; i < sim->maxTasks; ++i) {
+        int tenant = sutil_random() % host.numTenants();
+        host.submit(tenant, supplierGen.nextTask(host.store(tenant)));
+        tenant = sutil_random() % host.numTenants();
+        host.submit(tenant, customerGen.nextTask(host.store(tenant)));
+        sthread_sleep(0, 100000000);
+    }
+    host.stopWorkers(sim->numWorkers);
+
+    sthread_exit();
+    return nullptr;
+}
+
+/*
+ * ------------------------------------------------------------------
+ * hostedWorker --
+ *
+ *      A worker thread of the shared pool. The argument is a pointer
+ *      to the shared HostedSimulation.
+ *
+ *      Take tasks from the host in tenant round-robin order and
+ *      execute them.
+ *
+ * Results:
+ *      Does not return.
+ *
+ * ------------------------------------------------------------------
+ */
+static void*
+hostedWorker(void* arg)
+{
+    HostedSimulation* sim = static_cast<HostedSimulation*>(arg);
+
+    for (;;) {
+        Task t = sim->host.next();
+        if (t.handler == stop_handler) {
+            sthread_exit();
+        }
+        t.handler(t.arg);
+    }
+    return nullptr; // not reached
+}
+
+/*
+ * ------------------------------------------------------------------
+ * startHostedSimulation --
+ *
+ *      Like startSimulation, but with numTenants stores served by
+ *      one pool of numWorkers threads and one request generator.
+ *
+ * Results:
+ *      None.
+ *
+ * ------------------------------------------------------------------
+ */
+static void
+startHostedSimulation(int numTenants, int numWorkers, int maxTasks)
+{
+    HostedSimulation* sim = new HostedSimulation(numTenants, 1024);
+    sim->numWorkers = numWorkers;
+    sim->maxTasks   = maxTasks;
+
+    sthread_t genTid;
+    std::vector<sthread_t> workerTids(numWorkers);
+
+    for (int i = 0; i < numWorkers; ++i) {
+        sthread_create(&workerTids[i], hostedWorker, sim);
+    }
+    sthread_create(&genTid, hostedGenerator, sim);
+
+    sthread_join(genTid);
+    for (int i = 0; i < numWorkers; ++i) {
+        sthread_join(workerTids[i]);
+    }
+
     delete sim;
 }
 
@@ -226,8 +395,48 @@ int main(int argc, char **argv)
     // results, but make sure you put it back before turning in.
     srand(time(NULL));
     
-    if (argc > 1)
-        useFineMode = strcmp(argv[1], "--fine") == 0;
-    startSimulation(10, 10, 100, useFineMode);
+    int numTenants = 0;
+    bool fair = false;
+    int weights[NUM_REQUEST_TYPES];
+    for (int t = 0; t < NUM_REQUEST_TYPES; ++t)
+        weights[t] = requestTypes[t].handler == stop_handler ? 0 : 1;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--fine") == 0) {
+            useFineMode = true;
+        } else if (strcmp(argv[i], "--tenants") == 0 && i + 1 < argc) {
+            numTenants = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fair") == 0) {
+            fair = true;
+        } else if (strcmp(argv[i], "--weight") == 0 && i + 1 < argc) {
+            // --weight <request type>=<weight>
+            const char* spec = argv[++i];
+            const char* eq = strchr(spec, '=');
+            int t = 0;
+            while (eq && t < NUM_REQUEST_TYPES
+                   && (strlen(requestTypes[t].name) != (size_t) (eq - spec)
+                       || strncmp(requestTypes[t].name, spec, eq - spec) != 0))
+                ++t;
+            if (!eq || t == NUM_REQUEST_TYPES) {
+                fprintf(stderr, "bad --weight %s\n", spec);
+                return 1;
+            }
+            weights[t] = atoi(eq + 1);
+            fair = true;
+        }
+    }
+
+    // In coarse mode a buy_item task blocks its worker until stock
+    // arrives. With one shared queue, blocked buyers can take every
+    // worker and starve the suppliers that would wake them.
+    if (fair && !useFineMode && numTenants == 0) {
+        fprintf(stderr, "--fair and --weight need --fine\n");
+        return 1;
+    }
+
+    if (numTenants > 0)
+        startHostedSimulation(numTenants, 20, 100);
+    else
+        startSimulation(10, 10, 100, useFineMode, fair ? weights : nullptr);
     return 0;
 }
\ No newline at end of file
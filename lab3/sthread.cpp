@@ -42,6 +42,16 @@ void smutex_lock(smutex_t *mutex)
         handle_pthread_error("pthread_mutex_lock failed", rc);
 }
 
+int smutex_trylock(smutex_t *mutex)
+{
+    int rc = pthread_mutex_trylock(mutex);
+    if (rc == EBUSY)
+        return 0;
+    if (rc)
+        handle_pthread_error("pthread_mutex_trylock failed", rc);
+    return 1;
+}
+
 void smutex_unlock(smutex_t *mutex)
 {
     int rc;
@@ -102,6 +112,29 @@ void scond_wait(scond_t *cond, smutex_t *mutex)
         handle_pthread_error("pthread_cond_wait failed", rc);
 }
 
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    unsigned int seconds, unsigned int nanoseconds)
+{
+    struct timespec abstime;
+    int rc;
+
+    assert(nanoseconds < 1000000000);
+    clock_gettime(CLOCK_REALTIME, &abstime);
+    abstime.tv_sec += seconds;
+    abstime.tv_nsec += nanoseconds;
+    if (abstime.tv_nsec >= 1000000000) {
+        abstime.tv_sec++;
+        abstime.tv_nsec -= 1000000000;
+    }
+
+    rc = pthread_cond_timedwait(cond, mutex, &abstime);
+    if (rc == ETIMEDOUT)
+        return 1;
+    if (rc)
+        handle_pthread_error("pthread_cond_timedwait failed", rc);
+    return 0;
+}
+
 
 
 void sthread_create(sthread_t *thread,
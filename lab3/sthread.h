@@ -20,6 +20,12 @@ void smutex_destroy(smutex_t *mutex);
 void smutex_lock(smutex_t *mutex);
 void smutex_unlock(smutex_t *mutex);
 
+/*
+ * Lock the mutex only if nobody holds it. Returns 1 if the mutex
+ * was acquired, 0 if it is busy.
+ */
+int smutex_trylock(smutex_t *mutex);
+
 void scond_init(scond_t *cond);
 void scond_destroy(scond_t *cond);
 
@@ -35,6 +41,14 @@ void scond_signal(scond_t *cond, smutex_t *mutex);
 void scond_broadcast(scond_t *cond, smutex_t *mutex);
 void scond_wait(scond_t *cond, smutex_t *mutex);
 
+/*
+ * Like scond_wait, but give up after the given relative timeout.
+ * Returns 1 if the timeout expired, 0 otherwise. As with
+ * scond_wait, wakeups may be spurious: re-check the predicate.
+ */
+int scond_timedwait(scond_t *cond, smutex_t *mutex,
+                    unsigned int seconds, unsigned int nanoseconds);
+
 
 
 void sthread_create(sthread_t *thrd,
@@ -65,12 +65,20 @@ TICK_LIMIT = 0
 TICK_LIMIT ?= $(if $(DEPTICK_LIMIT),$(DEPTICK_LIMIT),0)
 NO_SLOWDOWN = 0
 NO_SLOWDOWN ?= $(if $(DEPNO_SLOWDOWN),$(DEPNO_SLOWDOWN),0)
-
-
-ifneq ($(FORCE_FORK) $(TICK_LIMIT) $(NO_SLOWDOWN),$(DEPFORCE_FORK) $(DEPTICK_LIMIT) $(DEPNO_SLOWDOWN))
-DEPSOL := $(shell mkdir -p $(DEPSDIR); echo >$(BUILDSTAMP); (echo DEPFORCE_FORK=$(FORCE_FORK); echo DEPTICK_LIMIT=$(TICK_LIMIT); echo DEPNO_SLOWDOWN=$(NO_SLOWDOWN)) >$(DEPSDIR)/_sol.d)
+LAZY_ALLOC = 0
+LAZY_ALLOC ?= $(if $(DEPLAZY_ALLOC),$(DEPLAZY_ALLOC),0)
+FAST_EXCEPTIONS = 0
+FAST_EXCEPTIONS ?= $(if $(DEPFAST_EXCEPTIONS),$(DEPFAST_EXCEPTIONS),0)
+STRIDE_SCHED = 0
+STRIDE_SCHED ?= $(if $(DEPSTRIDE_SCHED),$(DEPSTRIDE_SCHED),0)
+PROFILE = 0
+PROFILE ?= $(if $(DEPPROFILE),$(DEPPROFILE),0)
+
+
+ifneq ($(FORCE_FORK) $(TICK_LIMIT) $(NO_SLOWDOWN) $(LAZY_ALLOC) $(FAST_EXCEPTIONS) $(STRIDE_SCHED) $(PROFILE),$(DEPFORCE_FORK) $(DEPTICK_LIMIT) $(DEPNO_SLOWDOWN) $(DEPLAZY_ALLOC) $(DEPFAST_EXCEPTIONS) $(DEPSTRIDE_SCHED) $(DEPPROFILE))
+DEPSOL := $(shell mkdir -p $(DEPSDIR); echo >$(BUILDSTAMP); (echo DEPFORCE_FORK=$(FORCE_FORK); echo DEPTICK_LIMIT=$(TICK_LIMIT); echo DEPNO_SLOWDOWN=$(NO_SLOWDOWN); echo DEPLAZY_ALLOC=$(LAZY_ALLOC); echo DEPFAST_EXCEPTIONS=$(FAST_EXCEPTIONS); echo DEPSTRIDE_SCHED=$(STRIDE_SCHED); echo DEPPROFILE=$(PROFILE)) >$(DEPSDIR)/_sol.d)
 endif
-CPPFLAGS += -DFORCE_FORK=$(FORCE_FORK) -DTICK_LIMIT=$(TICK_LIMIT) -DNO_SLOWDOWN=$(NO_SLOWDOWN)
+CPPFLAGS += -DFORCE_FORK=$(FORCE_FORK) -DTICK_LIMIT=$(TICK_LIMIT) -DNO_SLOWDOWN=$(NO_SLOWDOWN) -DLAZY_ALLOC=$(LAZY_ALLOC) -DFAST_EXCEPTIONS=$(FAST_EXCEPTIONS) -DSTRIDE_SCHED=$(STRIDE_SCHED) -DPROFILE=$(PROFILE)
 
 # Qemu emulator
 INFERRED_QEMU := $(shell if which qemu-system-x86_64 2>/dev/null | grep ^/ >/dev/null 2>&1; \
@@ -78,8 +86,9 @@ INFERRED_QEMU := $(shell if which qemu-system-x86_64 2>/dev/null | grep ^/ >/dev
 	elif grep 16 /etc/fedora-release >/dev/null 2>&1; \
 	then echo qemu; else echo qemu-system-x86_64; fi)
 QEMU ?= $(INFERRED_QEMU)
-QEMUOPT	= -net none -parallel file:/tmp/log.txt
-QEMUGRADEOPT = -net none
+CPUS = 1
+QEMUOPT	= -net none -smp $(CPUS) -parallel file:/tmp/log.txt
+QEMUGRADEOPT = -net none -smp $(CPUS)
 QEMUCONSOLE ?= $(if $(DISPLAY),,1)
 QEMUDISPLAY = $(if $(QEMUCONSOLE),console,graphic)
 
@@ -12,8 +12,10 @@
 static void segments_init(void);
 static void interrupt_init(void);
 static void virtual_memory_init(void);
+static spinlock log_lock;
 
 void hardware_init(void) {
+    spinlock_init(&log_lock);
     segments_init();
     interrupt_init();
     virtual_memory_init();
@@ -32,6 +34,9 @@ void hardware_init(void) {
 //    The interrupt descriptor table tells the processor where to jump
 //    when an interrupt or exception happens. See k-interrupt.S.
 //
+//    Each CPU has its own task state segment, which holds the top of that
+//    CPU's kernel stack; the other tables are shared.
+//
 //    The taskstate_t, segmentdescriptor_t, and pseduodescriptor_t types
 //    are defined by the x86 hardware.
 
@@ -40,10 +45,10 @@ void hardware_init(void) {
 #define SEGSEL_APP_CODE         0x10            // application code segment
 #define SEGSEL_KERN_DATA        0x18            // kernel data segment
 #define SEGSEL_APP_DATA         0x20            // application data segment
-#define SEGSEL_TASKSTATE        0x28            // task state segment
+#define SEGSEL_TASKSTATE(cpu)   (0x28 + 16 * (cpu)) // task state segments
 
 // Segments
-static uint64_t segments[7];
+static uint64_t segments[5 + 2 * NCPU];
 
 static void set_app_segment(uint64_t* segment, uint64_t type, int dpl) {
     *segment = type
@@ -67,8 +72,8 @@ static void set_sys_segment(uint64_t* segment, uint64_t type, int dpl,
 // Interrupt descriptors
 static x86_64_gatedescriptor interrupt_descriptors[256];
 
-// Processor state for taking an interrupt
-static x86_64_taskstate kernel_task_descriptor;
+// Processor state for taking an interrupt, per CPU
+static x86_64_taskstate kernel_task_descriptors[NCPU];
 
 static void set_gate(x86_64_gatedescriptor* gate, uint64_t type, int dpl,
                      uintptr_t function) {
@@ -87,6 +92,12 @@ extern void default_int_handler(void);
 extern void gpf_int_handler(void);
 extern void pagefault_int_handler(void);
 extern void timer_int_handler(void);
+extern void spurious_int_handler(void);
+
+// Local APIC spurious interrupt vector
+#define INT_SPURIOUS            0xFF
+
+static void segments_load(int cpu);
 
 void segments_init(void) {
     // Segments for kernel & user code & data
@@ -97,17 +108,17 @@ void segments_init(void) {
     set_app_segment(&segments[SEGSEL_APP_CODE >> 3], X86SEG_X | X86SEG_L, 3);
     set_app_segment(&segments[SEGSEL_KERN_DATA >> 3], X86SEG_W, 0);
     set_app_segment(&segments[SEGSEL_APP_DATA >> 3], X86SEG_W, 3);
-    set_sys_segment(&segments[SEGSEL_TASKSTATE >> 3], X86SEG_TSS, 0,
-                    (uintptr_t) &kernel_task_descriptor,
-                    sizeof(kernel_task_descriptor));
 
-    x86_64_pseudodescriptor gdt;
-    gdt.pseudod_limit = sizeof(segments) - 1;
-    gdt.pseudod_base = (uint64_t) segments;
-
-    // Kernel task descriptor lets us receive interrupts
-    memset(&kernel_task_descriptor, 0, sizeof(kernel_task_descriptor));
-    kernel_task_descriptor.ts_rsp[0] = KERNEL_STACK_TOP;
+    // Kernel task descriptors let us receive interrupts, each CPU on its
+    // own kernel stack
+    memset(kernel_task_descriptors, 0, sizeof(kernel_task_descriptors));
+    for (int cpu = 0; cpu < NCPU; ++cpu) {
+        kernel_task_descriptors[cpu].ts_rsp[0] =
+            KERNEL_STACK_TOP - cpu * PAGESIZE;
+        set_sys_segment(&segments[SEGSEL_TASKSTATE(cpu) >> 3], X86SEG_TSS, 0,
+                        (uintptr_t) &kernel_task_descriptors[cpu],
+                        sizeof(kernel_task_descriptors[cpu]));
+    }
 
     // Interrupt handler; most interrupts are effectively ignored
     memset(interrupt_descriptors, 0, sizeof(interrupt_descriptors));
@@ -126,6 +137,10 @@ void segments_init(void) {
     set_gate(&interrupt_descriptors[INT_PAGEFAULT], X86GATE_INTERRUPT, 0,
              (uint64_t) pagefault_int_handler);
 
+    // Spurious local APIC interrupts
+    set_gate(&interrupt_descriptors[INT_SPURIOUS], X86GATE_INTERRUPT, 0,
+             (uint64_t) spurious_int_handler);
+
     // System calls get special handling.
     // Note that the last argument is '3'.  This means that unprivileged
     // (level-3) applications may generate these interrupts.
@@ -134,6 +149,19 @@ void segments_init(void) {
                  (uint64_t) sys_int_handlers[i - INT_SYS]);
     }
 
+    segments_load(0);
+}
+
+
+// segments_load(cpu)
+//    Load the segment and interrupt descriptor tables and CPU `cpu`'s
+//    task state segment, and set up control registers, on this CPU.
+
+static void segments_load(int cpu) {
+    x86_64_pseudodescriptor gdt;
+    gdt.pseudod_limit = sizeof(segments) - 1;
+    gdt.pseudod_base = (uint64_t) segments;
+
     x86_64_pseudodescriptor idt;
     idt.pseudod_limit = sizeof(interrupt_descriptors) - 1;
     idt.pseudod_base = (uint64_t) interrupt_descriptors;
@@ -143,7 +171,7 @@ void segments_init(void) {
                  "ltr %1\n\t"
                  "lidt %2"
                  : : "m" (gdt),
-                     "r" ((uint16_t) SEGSEL_TASKSTATE),
+                     "r" ((uint16_t) SEGSEL_TASKSTATE(cpu)),
                      "m" (idt)
                  : "memory");
 
@@ -261,11 +289,173 @@ void timer_init(int rate) {
 }
 
 
+// pit_read, pit_wait_period
+//    Read the timer's current count; wait until the timer starts its next
+//    period (the count reloads, so it goes up).
+
+#define   TIMER_LATCH   0x00            /* latch counter 0 for reading */
+
+static unsigned pit_read(void) {
+    outb(TIMER_MODE, TIMER_SEL0 | TIMER_LATCH);
+    unsigned lo = inb(IO_TIMER1);
+    return lo | (inb(IO_TIMER1) << 8);
+}
+
+static void pit_wait_period(void) {
+    unsigned last = pit_read();
+    while (1) {
+        unsigned now = pit_read();
+        if (now > last) {
+            return;
+        }
+        last = now;
+    }
+}
+
+
+// cpus_start, cpus_stop, lapic_eoi
+//    Start and stop the application processors. Each CPU's local APIC
+//    sends and receives the IPIs involved; an application processor's
+//    local APIC timer is its only interrupt, as the 8259A interrupts,
+//    including the timer programmed by timer_init(), go to the boot CPU
+//    through its LINT0 pin. The local APIC registers are mapped in
+//    `kernel_pagetable` only.
+
+#define LAPIC_ID                0x020
+#define LAPIC_EOI               0x0B0
+#define LAPIC_SVR               0x0F0   // spurious interrupt vector
+#define   LAPIC_SVR_ENABLE      0x100
+#define LAPIC_ICR_LOW           0x300   // interrupt command
+#define   LAPIC_ICR_INIT        0x500
+#define   LAPIC_ICR_STARTUP     0x600
+#define   LAPIC_ICR_PENDING     0x1000
+#define   LAPIC_ICR_ASSERT      0x4000
+#define   LAPIC_ICR_OTHERS      0xC0000 // all CPUs but this one
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_TIMER             0x320   // local vector table entries
+#define LAPIC_LINT0             0x350
+#define LAPIC_LINT1             0x360
+#define   LAPIC_PERIODIC        0x20000
+#define   LAPIC_MASKED          0x10000
+#define   LAPIC_EXTINT          0x700
+#define   LAPIC_NMI             0x400
+#define LAPIC_TIMER_INIT        0x380
+#define LAPIC_TIMER_COUNT       0x390
+#define LAPIC_TIMER_DIVIDE      0x3E0
+#define   LAPIC_DIVIDE_16       0x3
+#define MSR_IA32_APIC_BASE      0x1B
+
+static uintptr_t lapic_pa;              // local APIC registers
+
+// Shared with ap_start (k-exception.S)
+extern char ap_start[];
+extern uint32_t ap_start_cr3;           // page table to start on
+int ap_next_index;                      // next CPU index to take
+const int ap_ncpu = NCPU;               // CPUs with a kernel stack
+const uintptr_t ap_stack_top = KERNEL_STACK_TOP;
+
+static int ncpus_started;
+static uint32_t lapic_timer_count;      // timer count per period
+
+static uint32_t lapic_read(int reg) {
+    return *(volatile uint32_t*) (lapic_pa + reg);
+}
+
+static void lapic_write(int reg, uint32_t value) {
+    *(volatile uint32_t*) (lapic_pa + reg) = value;
+    (void) lapic_read(LAPIC_ID);        // wait for the write to finish
+}
+
+static void lapic_ipi_others(uint32_t command) {
+    lapic_write(LAPIC_ICR_HIGH, 0);
+    lapic_write(LAPIC_ICR_LOW, LAPIC_ICR_OTHERS | command);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+}
+
+int cpus_start(void) {
+    assert(cpu_index() == 0);
+    assert((uintptr_t) ap_start % PAGESIZE == 0
+           && (uintptr_t) ap_start < 0x100000);
+
+    // The boot CPU keeps taking 8259A interrupts through LINT0.
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_SPURIOUS);
+    lapic_write(LAPIC_LINT0, LAPIC_EXTINT);
+    lapic_write(LAPIC_LINT1, LAPIC_NMI);
+    lapic_write(LAPIC_TIMER, LAPIC_MASKED);
+
+    // Count local APIC timer ticks over one PIT period. All local APIC
+    // timers run at the same rate.
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    pit_wait_period();
+    lapic_write(LAPIC_TIMER_INIT, 0xFFFFFFFF);
+    pit_wait_period();
+    lapic_timer_count = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_COUNT);
+    lapic_write(LAPIC_TIMER_INIT, 0);
+
+    // INIT, then STARTUP twice, as the MultiProcessor Specification says;
+    // a processor already started ignores the second STARTUP. Each PIT
+    // period is well over the 10ms and 200us the processors need.
+    ap_start_cr3 = (uintptr_t) kernel_pagetable;
+    ap_next_index = 1;
+    ncpus_started = 1;
+    lapic_ipi_others(LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+    pit_wait_period();
+    for (int i = 0; i < 2; ++i) {
+        lapic_ipi_others(LAPIC_ICR_STARTUP
+                         | ((uintptr_t) ap_start / PAGESIZE));
+        pit_wait_period();
+    }
+    // Give the processors time to reach ap_entry()
+    for (int i = 0; i < 10; ++i) {
+        pit_wait_period();
+    }
+    return __atomic_load_n(&ncpus_started, __ATOMIC_ACQUIRE);
+}
+
+void cpus_stop(void) {
+    if (ncpus_started > 1) {
+        lapic_ipi_others(LAPIC_ICR_INIT | LAPIC_ICR_ASSERT);
+        ncpus_started = 1;
+    }
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+
+// ap_entry(index)
+//    Called by ap_start (k-exception.S) on application processor `index`,
+//    on its kernel stack with `kernel_pagetable` loaded. Sets the CPU up
+//    like the boot CPU, starts its local APIC timer, and joins the
+//    scheduler.
+
+void ap_entry(int index) __attribute__((noreturn));
+void ap_entry(int index) {
+    assert(cpu_index() == index);
+    segments_load(index);
+
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_SPURIOUS);
+    lapic_write(LAPIC_LINT0, LAPIC_MASKED);
+    lapic_write(LAPIC_LINT1, LAPIC_MASKED);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_TIMER, LAPIC_PERIODIC | INT_TIMER);
+    lapic_write(LAPIC_TIMER_INIT, lapic_timer_count);
+
+    __atomic_add_fetch(&ncpus_started, 1, __ATOMIC_RELEASE);
+    schedule();
+ spinloop: goto spinloop;       // should never get here
+}
+
+
 // virtual_memory_init
 //    Initialize the virtual memory system, including an initial page table
-//    `kernel_pagetable`.
+//    `kernel_pagetable`. That page table also identity-maps the local APIC
+//    registers, uncached; process page tables don't.
 
-static x86_64_pagetable kernel_pagetables[5];
+static x86_64_pagetable kernel_pagetables[7];
 x86_64_pagetable* kernel_pagetable;
 
 void virtual_memory_init(void) {
@@ -283,6 +473,17 @@ void virtual_memory_init(void) {
     virtual_memory_map(kernel_pagetable, (uintptr_t) 0, (uintptr_t) 0,
                        MEMSIZE_PHYSICAL, PTE_P | PTE_W | PTE_U, NULL);
 
+    // virtual_memory_map() only maps physical memory, so map the local
+    // APIC page (at 0xFEE00000 unless moved) by hand
+    lapic_pa = rdmsr(MSR_IA32_APIC_BASE) & 0xFFFFFF000UL;
+    assert(L1PAGEINDEX(lapic_pa) == 0 && L2PAGEINDEX(lapic_pa) != 0);
+    kernel_pagetables[1].entry[L2PAGEINDEX(lapic_pa)] =
+        (x86_64_pageentry_t) &kernel_pagetables[5] | PTE_P | PTE_W;
+    kernel_pagetables[5].entry[L3PAGEINDEX(lapic_pa)] =
+        (x86_64_pageentry_t) &kernel_pagetables[6] | PTE_P | PTE_W;
+    kernel_pagetables[6].entry[L4PAGEINDEX(lapic_pa)] =
+        lapic_pa | PTE_P | PTE_W | PTE_PWT | PTE_PCD;
+
     lcr3((uintptr_t) kernel_pagetable);
 }
 
@@ -342,6 +543,34 @@ int virtual_memory_map(x86_64_pagetable* pagetable, uintptr_t va,
     return 0;
 }
 
+// virtual_memory_map_pages(pagetable, va, pas, npages, perm, allocator)
+//    Map `npages` pages at `va` to the physical pages in `pas[]`. Returns
+//    the number of pages mapped.
+
+size_t virtual_memory_map_pages(x86_64_pagetable* pagetable, uintptr_t va,
+                                const uintptr_t* pas, size_t npages, int perm,
+                                x86_64_pagetable* (*allocator)(void)) {
+    assert(va % PAGESIZE == 0); // virtual address is page-aligned
+    assert(va + npages * PAGESIZE >= va); // va range does not wrap
+    assert((perm & PTE_P) && perm < 0x1000); // `perm` makes sense
+
+    int last_index123 = -1;
+    x86_64_pagetable* l4pagetable = NULL;
+    for (size_t i = 0; i < npages; ++i, va += PAGESIZE) {
+        assert(pas[i] % PAGESIZE == 0 && pas[i] < MEMSIZE_PHYSICAL);
+        int cur_index123 = (va >> (PAGEOFFBITS + PAGEINDEXBITS));
+        if (cur_index123 != last_index123) {
+            l4pagetable = lookup_l4pagetable(pagetable, va, perm, allocator);
+            last_index123 = cur_index123;
+        }
+        if (!l4pagetable) {
+            return i;
+        }
+        l4pagetable->entry[L4PAGEINDEX(va)] = pas[i] | perm;
+    }
+    return npages;
+}
+
 static x86_64_pagetable* lookup_l4pagetable(x86_64_pagetable* pagetable,
                  uintptr_t va, int perm, x86_64_pagetable* (*allocator)(void)) {
     x86_64_pagetable* pt = pagetable;
@@ -359,7 +588,7 @@ static x86_64_pagetable* lookup_l4pagetable(x86_64_pagetable* pagetable,
             assert((uintptr_t) new_pt % PAGESIZE == 0);
             pt->entry[PAGEINDEX(va, i)] = pe =
                 PTE_ADDR(new_pt) | PTE_P | PTE_W | PTE_U;
-            memset(new_pt, 0, PAGESIZE);
+            page_zero(new_pt);
         }
 
         // sanity-check page entry
@@ -395,12 +624,86 @@ vamapping virtual_memory_lookup(x86_64_pagetable* pagetable, uintptr_t va) {
     if (perms & PTE_P) {
         vam.pn = PAGENUMBER(pe);
         vam.pa = PTE_ADDR(pe) + PAGEOFFSET(va);
-        vam.perm = perms;
+        vam.perm = perms | (PTE_FLAGS(pe) & PTE_AVAIL);
     }
     return vam;
 }
 
 
+// virtual_memory_iter_init(it, pagetable, va, end)
+// virtual_memory_iter_next(it)
+//    Iterate over the present last-level mappings of `[va, end)` in
+//    `pagetable`. See kernel.h.
+
+#define L4PAGESPAN ((uintptr_t) PAGESIZE << PAGEINDEXBITS)
+
+void virtual_memory_iter_init(vmiter* it, x86_64_pagetable* pagetable,
+                              uintptr_t va, uintptr_t end) {
+    assert(PAGEOFFSET(pagetable) == 0);
+    it->pagetable = pagetable;
+    it->va = (uintptr_t) -1;
+    it->next = va & ~PAGEOFFMASK;
+    it->end = end;
+    it->l4pagetable = NULL;
+    it->l4perms = 0;
+}
+
+int virtual_memory_iter_next(vmiter* it) {
+    while (it->next < it->end) {
+        uintptr_t va = it->next;
+
+        // find the last-level page table for `va`, skipping the whole
+        // range of any absent upper-level entry
+        if (!it->l4pagetable) {
+            x86_64_pagetable* pt = it->pagetable;
+            int perms = PTE_P | PTE_W | PTE_U;
+            int level;
+            for (level = 0; level <= 2; ++level) {
+                x86_64_pageentry_t pe = pt->entry[PAGEINDEX(va, level)];
+                if (!(pe & PTE_P)) {
+                    break;
+                }
+                perms &= PTE_FLAGS(pe);
+                pt = (x86_64_pagetable*) PTE_ADDR(pe);
+            }
+            if (level <= 2) {
+                uintptr_t span = (uintptr_t) PAGESIZE
+                    << ((3 - level) * PAGEINDEXBITS);
+                it->next = (va & ~(span - 1)) + span;
+                if (it->next <= va) {   // wrapped around
+                    break;
+                }
+                continue;
+            }
+            it->l4pagetable = pt;
+            it->l4perms = perms;
+        }
+
+        // scan it up to the end of its range
+        uintptr_t l4end = (va & ~(L4PAGESPAN - 1)) + L4PAGESPAN;
+        for (; va < it->end && va < l4end; va += PAGESIZE) {
+            x86_64_pageentry_t pe = it->l4pagetable->entry[L4PAGEINDEX(va)];
+            int perms = it->l4perms & PTE_FLAGS(pe);
+            if (perms & PTE_P) {
+                it->va = va;
+                it->map.pn = PAGENUMBER(pe);
+                it->map.pa = PTE_ADDR(pe);
+                it->map.perm = perms | (PTE_FLAGS(pe) & PTE_AVAIL);
+                it->next = va + PAGESIZE;
+                if (it->next == l4end) {
+                    it->l4pagetable = NULL;
+                }
+                return 1;
+            }
+        }
+        it->next = va;
+        it->l4pagetable = NULL;
+    }
+    it->va = (uintptr_t) -1;
+    return 0;
+}
+
+
 // set_pagetable
 //    Change page directory. lcr3() is the hardware instruction;
 //    set_pagetable() additionally checks that important kernel procedures are
@@ -480,6 +783,7 @@ static int pci_find_device(int vendor, int device) {
 #define PCI_DEVICE_ID_PIIX4     0x7113
 
 void poweroff(void) {
+    profile_dump();
     int configaddr = pci_find_device(PCI_VENDOR_ID_INTEL, PCI_DEVICE_ID_PIIX4);
     if (configaddr >= 0) {
         // Read I/O base register from controller's PCI configuration space.
@@ -692,7 +996,9 @@ static void parallel_port_putc(printer* p, unsigned char c, int color) {
 void log_vprintf(const char* format, va_list val) {
     printer p;
     p.putc = parallel_port_putc;
+    spinlock_lock(&log_lock);           // keep other CPUs' lines whole
     printer_vprintf(&p, 0, format, val);
+    spinlock_unlock(&log_lock);
 }
 
 void log_printf(const char* format, ...) {
@@ -725,14 +1031,26 @@ int error_printf(int cpos, int color, const char* format, ...) {
 
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
-//    Returns key typed or -1 for no key.
+//    Check for the user typing a control key. 'a', 'f', 'e', 'b', 's',
+//    'y', 'm', 'l', 'p', and 't' cause a soft reboot where the kernel runs
+//    the allocator programs, "fork", "forkexit", "pagebench", "forkstress",
+//    "syscallbench", "membench", "latency", "pingpong", or "sametext",
+//    respectively.
+//    Control-C or 'q' exit the virtual machine.
+//    Returns key typed or -1 for no key. Only the boot CPU reads the
+//    keyboard; elsewhere this returns -1.
 
 int check_keyboard(void) {
+    if (cpu_index() != 0) {
+        return -1;
+    }
     int c = keyboard_readc();
-    if (c == 'a' || c == 'f' || c == 'e') {
+    if (c == 'a' || c == 'f' || c == 'e' || c == 'b' || c == 's'
+        || c == 'y' || c == 'm' || c == 'l' || c == 'p' || c == 't') {
+        // Park the other CPUs; the rebooted kernel starts them again.
+        lcr3((uintptr_t) kernel_pagetable);
+        cpus_stop();
+
         // Install a temporary page table to carry us through the
         // process of reinitializing memory. This replicates work the
         // bootloader does.
@@ -752,6 +1070,20 @@ int check_keyboard(void) {
             argument = "allocator";
         } else if (c == 'e') {
             argument = "forkexit";
+        } else if (c == 'b') {
+            argument = "pagebench";
+        } else if (c == 's') {
+            argument = "forkstress";
+        } else if (c == 'y') {
+            argument = "syscallbench";
+        } else if (c == 'm') {
+            argument = "membench";
+        } else if (c == 'l') {
+            argument = "latency";
+        } else if (c == 'p') {
+            argument = "pingpong";
+        } else if (c == 't') {
+            argument = "sametext";
         }
         uintptr_t argument_ptr = (uintptr_t) argument;
         assert(argument_ptr < 0x100000000L);
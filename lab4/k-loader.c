@@ -21,6 +21,16 @@ extern uint8_t _binary_obj_p_fork_start[];
 extern uint8_t _binary_obj_p_fork_end[];
 extern uint8_t _binary_obj_p_forkexit_start[];
 extern uint8_t _binary_obj_p_forkexit_end[];
+extern uint8_t _binary_obj_p_pagebench_start[];
+extern uint8_t _binary_obj_p_pagebench_end[];
+extern uint8_t _binary_obj_p_forkstress_start[];
+extern uint8_t _binary_obj_p_forkstress_end[];
+extern uint8_t _binary_obj_p_syscallbench_start[];
+extern uint8_t _binary_obj_p_syscallbench_end[];
+extern uint8_t _binary_obj_p_latency_start[];
+extern uint8_t _binary_obj_p_latency_end[];
+extern uint8_t _binary_obj_p_pingpong_start[];
+extern uint8_t _binary_obj_p_pingpong_end[];
 
 struct ramimage {
     void* begin;
@@ -31,13 +41,87 @@ struct ramimage {
     { _binary_obj_p_allocator3_start, _binary_obj_p_allocator3_end },
     { _binary_obj_p_allocator4_start, _binary_obj_p_allocator4_end },
     { _binary_obj_p_fork_start, _binary_obj_p_fork_end },
-    { _binary_obj_p_forkexit_start, _binary_obj_p_forkexit_end }
+    { _binary_obj_p_forkexit_start, _binary_obj_p_forkexit_end },
+    { _binary_obj_p_pagebench_start, _binary_obj_p_pagebench_end },
+    { _binary_obj_p_forkstress_start, _binary_obj_p_forkstress_end },
+    { _binary_obj_p_syscallbench_start, _binary_obj_p_syscallbench_end },
+    { _binary_obj_p_latency_start, _binary_obj_p_latency_end },
+    { _binary_obj_p_pingpong_start, _binary_obj_p_pingpong_end }
 };
 
-static int program_load_segment(proc* p, const elf_program* ph,
-                                const uint8_t* src,
+static int program_load_segment(proc* p, int programnumber,
+                                const elf_program* ph, const uint8_t* src,
                                 x86_64_pagetable* (*allocator)(void));
 
+
+// TEXT PAGE CACHE
+//
+//    Pages of read-only segments are loaded once per program and then
+//    mapped read-only into every process that loads the same program. A
+//    cache entry names the physical page holding the page of program
+//    `tc_program` that starts at file offset `tc_offset`; it holds no
+//    reference of its own, and page_free() evicts it with the page.
+//    `text_cached` has the bit for each cached physical page set.
+
+#define NTEXTCACHE 64
+
+typedef struct text_cache_entry {
+    int tc_program;
+    uint64_t tc_offset;
+    uintptr_t tc_pa;                    // 0 if the entry is unused
+} text_cache_entry;
+
+static text_cache_entry text_cache[NTEXTCACHE];
+static uint64_t text_cached[PAGENUMBER(MEMSIZE_PHYSICAL) / 64];
+static int text_shared;                 // pages shared by this program_load
+
+void text_cache_init(void) {
+    memset(text_cache, 0, sizeof(text_cache));
+    memset(text_cached, 0, sizeof(text_cached));
+}
+
+void text_cache_evict(uintptr_t addr) {
+    int pn = PAGENUMBER(addr);
+    if (!(text_cached[pn / 64] & (1UL << (pn % 64)))) {
+        return;
+    }
+    text_cached[pn / 64] &= ~(1UL << (pn % 64));
+    for (int i = 0; i < NTEXTCACHE; ++i) {
+        if (text_cache[i].tc_pa == addr) {
+            text_cache[i].tc_pa = 0;
+        }
+    }
+}
+
+// text_cache_lookup(programnumber, offset)
+//    Returns the cached page for `offset` in program `programnumber`,
+//    or 0 if it is not cached.
+static uintptr_t text_cache_lookup(int programnumber, uint64_t offset) {
+    for (int i = 0; i < NTEXTCACHE; ++i) {
+        if (text_cache[i].tc_pa && text_cache[i].tc_program == programnumber
+            && text_cache[i].tc_offset == offset) {
+            return text_cache[i].tc_pa;
+        }
+    }
+    return 0;
+}
+
+// text_cache_insert(programnumber, offset, pa)
+//    Caches `pa` as the page for `offset` in program `programnumber`. A
+//    page that finds the cache full simply stays private.
+static void text_cache_insert(int programnumber, uint64_t offset,
+                              uintptr_t pa) {
+    for (int i = 0; i < NTEXTCACHE; ++i) {
+        if (!text_cache[i].tc_pa) {
+            text_cache[i].tc_program = programnumber;
+            text_cache[i].tc_offset = offset;
+            text_cache[i].tc_pa = pa;
+            text_cached[PAGENUMBER(pa) / 64] |= 1UL << (PAGENUMBER(pa) % 64);
+            return;
+        }
+    }
+}
+
 // program_load(p, programnumber)
 //    Load the code corresponding to program `programnumber` into the process
 //    `p` and set `p->p_registers.reg_rip` to its entry point. Calls
@@ -54,15 +138,21 @@ int program_load(proc* p, int programnumber,
     assert(eh->e_magic == ELF_MAGIC);
 
     // load each loadable program segment into memory
+    text_shared = 0;
     elf_program* ph = (elf_program*) ((const uint8_t*) eh + eh->e_phoff);
     for (int i = 0; i < eh->e_phnum; ++i) {
         if (ph[i].p_type == ELF_PTYPE_LOAD) {
             const uint8_t* pdata = (const uint8_t*) eh + ph[i].p_offset;
-            if (program_load_segment(p, &ph[i], pdata, allocator) < 0) {
+            if (program_load_segment(p, programnumber, &ph[i], pdata,
+                                     allocator) < 0) {
                 return -1;
             }
         }
     }
+    if (text_shared) {
+        log_printf("program_load(pid %d): program %d, %d text pages shared\n",
+                   p->p_pid, programnumber, text_shared);
+    }
 
     // set the entry point from the ELF header
     p->p_registers.reg_rip = eh->e_entry;
@@ -70,38 +160,100 @@ int program_load(proc* p, int programnumber,
 }
 
 
-// program_load_segment(p, ph, src, allocator)
+// segment_page_alloc(p, addr)
+//    Returns a physical page for process `p`'s page at `addr`: the page at
+//    physical address `addr` if it is free, as before, or else any free
+//    page (e.g. when another instance of the program has that one).
+//    Returns 0 if physical memory is exhausted.
+
+static uintptr_t segment_page_alloc(proc* p, uintptr_t addr) {
+    if (assign_physical_page(addr, p->p_pid) == 0) {
+        return addr;
+    }
+    return page_alloc(p->p_pid);
+}
+
+
+// segment_page_fill(pa, ph, src, addr)
+//    Fills physical page `pa` with the page at `addr` of segment `ph`,
+//    whose file contents are at `src`, writing through the kernel's
+//    identity mapping of physical memory. Whole file pages are copied
+//    with page_copy() and pages past the file contents cleared with
+//    page_zero(); only partial pages fall back to memcpy().
+
+static void segment_page_fill(uintptr_t pa, const elf_program* ph,
+                              const uint8_t* src, uintptr_t addr) {
+    uintptr_t first = MAX(addr, (uintptr_t) ph->p_va);
+    uintptr_t last = MIN(addr + PAGESIZE,
+                         (uintptr_t) ph->p_va + ph->p_filesz);
+    if (first == addr && last == addr + PAGESIZE) {
+        page_copy((void*) pa, src + (first - ph->p_va));
+        return;
+    }
+    page_zero((void*) pa);
+    if (first < last) {
+        memcpy((uint8_t*) pa + (first - addr),
+               src + (first - ph->p_va), last - first);
+    }
+}
+
+
+// program_load_segment(p, programnumber, ph, src, allocator)
 //    Load an ELF segment at virtual address `ph->p_va` in process `p`. Copies
 //    `[src, src + ph->p_filesz)` to `dst`, then clears
 //    `[ph->p_va + ph->p_filesz, ph->p_va + ph->p_memsz)` to 0.
-//    Calls `assign_physical_page` to allocate pages and `virtual_memory_map`
-//    to map them in `p->p_pagetable`. Returns 0 on success and -1 on failure.
+//    Calls `assign_physical_page` to allocate pages, fills them through the
+//    kernel's identity mapping (so the page table is never switched), and
+//    maps them into `p->p_pagetable` up to LOAD_BATCH pages per
+//    `virtual_memory_map_pages` call. Pages of read-only segments come from
+//    the text page cache when another process has loaded the same program,
+//    and are mapped without PTE_W. Returns 0 on success and -1 on failure.
+
+#define LOAD_BATCH 64
 
-static int program_load_segment(proc* p, const elf_program* ph,
-                                const uint8_t* src,
+static int program_load_segment(proc* p, int programnumber,
+                                const elf_program* ph, const uint8_t* src,
                                 x86_64_pagetable* (*allocator)(void)) {
-    uintptr_t va = (uintptr_t) ph->p_va;
-    uintptr_t end_file = va + ph->p_filesz, end_mem = va + ph->p_memsz;
-    va &= ~(PAGESIZE - 1);                // round to page boundary
-
-    // allocate memory
-    for (uintptr_t addr = va; addr < end_mem; addr += PAGESIZE) {
-        if (assign_physical_page(addr, p->p_pid) < 0
-            || virtual_memory_map(p->p_pagetable, addr, addr, PAGESIZE,
-                                  PTE_P | PTE_W | PTE_U, allocator) < 0) {
-            console_printf(CPOS(22, 0), 0xC000, "program_load_segment(pid %d): can't assign address %p\n", p->p_pid, addr);
+    uintptr_t va = ROUNDDOWN((uintptr_t) ph->p_va, PAGESIZE);
+    uintptr_t end_mem = ph->p_va + ph->p_memsz;
+    int writable = ph->p_flags & ELF_PFLAG_WRITE;
+    int perm = PTE_P | PTE_U | (writable ? PTE_W : 0);
+    uintptr_t pas[LOAD_BATCH];
+
+    while (va < end_mem) {
+        // allocate and fill a batch of pages
+        size_t n = 0;
+        for (uintptr_t addr = va; n < LOAD_BATCH && addr < end_mem;
+             ++n, addr += PAGESIZE) {
+            // `key` is the page's file offset (the first page can start
+            // before `ph->p_va`; unsigned arithmetic handles that)
+            uint64_t key = ph->p_offset + (addr - ph->p_va);
+            uintptr_t pa = 0;
+            if (!writable && (pa = text_cache_lookup(programnumber, key))) {
+                page_ref(pa);
+                ++text_shared;
+            } else if ((pa = segment_page_alloc(p, addr))) {
+                segment_page_fill(pa, ph, src, addr);
+                if (!writable) {
+                    text_cache_insert(programnumber, key, pa);
+                }
+            } else {
+                break;
+            }
+            pas[n] = pa;
+        }
+
+        // map it with one call
+        size_t m = virtual_memory_map_pages(p->p_pagetable, va, pas, n,
+                                            perm, allocator);
+        if (m < n || (n < LOAD_BATCH && va + n * PAGESIZE < end_mem)) {
+            for (size_t i = m; i < n; ++i) {
+                page_free(pas[i]);
+            }
+            console_printf(CPOS(22, 0), 0xC000, "program_load_segment(pid %d): can't assign address %p\n", p->p_pid, va + m * PAGESIZE);
             return -1;
         }
+        va += n * PAGESIZE;
     }
-
-    // ensure new memory mappings are active
-    set_pagetable(p->p_pagetable);
-
-    // copy data from executable image into process memory
-    memcpy((uint8_t*) va, src, end_file - va);
-    memset((uint8_t*) end_file, 0, end_mem - end_file);
-
-    // restore kernel pagetable
-    set_pagetable(kernel_pagetable);
     return 0;
 }
@@ -23,13 +23,173 @@
 
 static proc processes[NPROC];   // array of process descriptors
                                 // Note that `processes[0]` is never used.
-proc* current;                  // pointer to currently executing proc
+
+// PER-CPU STATE AND LOCKING
+//
+//    kernel() starts up to NCPU CPUs (see cpus_start()). Each has its own
+//    kernel stack, current process and run queue, reached through
+//    this_cpu(), and a CPU whose run queue is empty steals work from the
+//    others'. CPU 0 takes the PIT timer interrupts, which count `ticks`,
+//    and alone runs the invariant checks, the memory display and the
+//    keyboard. Interrupts are disabled in the kernel, so the locks only
+//    keep other CPUs out:
+//
+//    - `proc_lock` protects process states and slots, the sleep and futex
+//      queues, and `ticks`. A CPU that blocks or frees its current process
+//      clears `cpu_current` before releasing it: once woken, the process
+//      may run on another CPU.
+//    - `page_lock` protects pageinfo[] and the free page bitmap, process
+//      page tables, the shared memory regions, and the memory display's
+//      dirty bits. Only the CPU running a process changes its page table,
+//      so that CPU may read it without the lock.
+//    - Each CPU's `cpu_lock` protects its run queue.
+//    - `stats_lock` and `profile_lock` protect the exception statistics
+//      and the profile table.
+//
+//    proc_lock is taken before page_lock, and both before any cpu_lock.
+//    CPU 0 holds proc_lock and page_lock while it checks or displays.
+
+typedef struct cpustate {
+    int cpu_index;
+    proc* cpu_current;                  // process running on this CPU
+    spinlock cpu_lock;
+    proc* cpu_runq_head;                // this CPU's run queue
+    proc* cpu_runq_tail;
+    uint64_t cpu_pass;                  // pass of the last process picked
+    unsigned cpu_nruns;                 // turns run since last sched log,
+    unsigned cpu_nstolen;               //   and how many were stolen
+    exception_stats* cpu_trap_stats;    // exception being handled, if
+    uint64_t cpu_trap_start;            //   tracked, and its entry time
+} cpustate;
+
+static cpustate cpus[NCPU];
+static int ncpu;                        // CPUs running
+static spinlock proc_lock;
+static spinlock page_lock;
+
+static inline cpustate* this_cpu(void) {
+    return &cpus[cpu_index()];
+}
+
+#define current (this_cpu()->cpu_current) // currently executing proc
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
-static unsigned ticks;          // # timer interrupts so far
+                                // `ticks` (lib.h) counts timer interrupts
+
+// With FAST_EXCEPTIONS, user exceptions skip the invariant checks and the
+// memory display: check_virtual_memory() runs on every CHECK_TICKS-th
+// timer interrupt, the display is redrawn on every DISPLAY_TICKS-th, and
+// the keyboard is polled on timer interrupts only.
+#if FAST_EXCEPTIONS
+#define CHECK_TICKS HZ          // check invariants once a second
+#define DISPLAY_TICKS (HZ / 25) // redraw at 25 frames/sec
+#endif
 
-void schedule(void);
 void run(proc* p) __attribute__((noreturn));
+
+// RUN QUEUE
+//
+//    Runnable processes other than the running ones wait on their CPU's
+//    doubly linked run queue, threaded through their `proc`s. schedule()
+//    puts a runnable `current` at the back and runs the process at the
+//    front, so picking the next process is O(1) however many slots are
+//    free. A CPU with nothing queued takes the process at the back of
+//    another CPU's queue, which that CPU would have run last. With
+//    STRIDE_SCHED, schedule() instead runs the queued process with the
+//    lowest pass, and each turn advances its pass by its stride: processes
+//    set up at boot get tickets equal to their pid (stride STRIDE1 /
+//    tickets), and forked children inherit their parent's stride.
+//    Passes are per CPU; a stolen process is brought up to the thief's.
+
+#define STRIDE1 (1UL << 20)
+
+static uint64_t sched_cycles;           // time spent picking, logged
+static unsigned sched_count;            //   once a second
+
+static void runq_push(cpustate* c, proc* p);
+static void runq_remove(cpustate* c, proc* p);
+static proc* runq_pick(cpustate* c);
+static proc* runq_steal(cpustate* c);
+static void sched_admit(proc* p, uint64_t stride);
+static void sched_log(void);
+
+// SLEEP QUEUE
+//
+//    Processes blocked in sys_sleep wait on the sleep queue, ordered by
+//    wakeup tick and linked through the same `p_runq_next` pointers (a
+//    sleeping process is never on the run queue). Each timer tick moves
+//    the processes whose time has come back onto the run queue. When
+//    nothing is runnable, schedule() halts the CPU with interrupts enabled
+//    until the next interrupt, which exception() takes in kernel mode.
+
+static proc* sleepq_head;
+
+static void sleepq_insert(proc* p);
+static void sched_wake(proc* p);
+static void timer_tick(void);
+
+// SHARED MEMORY AND FUTEXES
+//
+//    A shared memory region is a set of pages, each holding one reference
+//    for the region plus one for every page table that maps it (with
+//    PTE_SHARED). `shm_held[pid]` has bit `id` set if process `pid`
+//    created, mapped, or inherited region `id`; the region's pages are
+//    released when its last holder exits. `shm_mapped[pid]` has bit `id`
+//    set if `pid` maps region `id`, which it may do only once, so a page
+//    has at most one reference per process plus the region's. Processes blocked in
+//    sys_futex_wait queue in FIFO order on `futexq_head`, linked through
+//    `p_runq_next`, and are matched on the physical address of the word,
+//    so futex words must live in shared memory: any other page can be
+//    shared copy-on-write or replaced by a copy, which would change it.
+
+#define NSHM 8
+#define SHM_MAXPAGES 16
+
+typedef struct shm_region {
+    size_t npages;                      // 0 if the slot is free
+    uintptr_t pas[SHM_MAXPAGES];
+    int nholders;
+} shm_region;
+
+static shm_region shm_regions[NSHM];
+static uint16_t shm_held[NPROC];
+static uint16_t shm_mapped[NPROC];
+static proc* futexq_head;
+
+static int shm_create(proc* p, size_t npages);
+static int shm_map(proc* p, int id, uintptr_t va);
+static void shm_inherit(proc* child, proc* parent);
+static void shm_release(proc* p);
+static uintptr_t futex_address(proc* p, uintptr_t va);
+
+// PROFILER
+//
+//    With PROFILE, every timer interrupt records where it found the CPU:
+//    the interrupted %rip, the pid and program running, and the mode. The
+//    samples are counted in a fixed-size open-addressed hash table and
+//    logged by profile_dump() at poweroff, as `PROFILE` lines that
+//    `profile_report.py` symbolizes. Every CPU samples its own timer
+//    interrupts. The kernel runs with interrupts disabled, so kernel-mode
+//    samples only ever land in schedule()'s idle loop; time spent in
+//    exception() shows up as fewer user samples.
+
+#define PROFILE_SLOTS 1024              // must be a power of 2
+
+typedef struct profile_entry {
+    uintptr_t rip;
+    pid_t pid;                          // 0 for kernel-mode samples
+    int8_t program;                     // -1 for kernel-mode samples
+    unsigned count;
+} profile_entry;
+
+#if PROFILE
+static profile_entry profile_table[PROFILE_SLOTS];
+static unsigned profile_nsamples;
+static unsigned profile_dropped;        // samples lost to a full table
+#endif
+static spinlock profile_lock;
+
+static void profile_sample(x86_64_registers* reg);
 static int current_pt_owner = 0;
 
 // PAGEINFO
@@ -52,7 +212,7 @@ static int current_pt_owner = 0;
 
 typedef struct physical_pageinfo {
     int8_t owner;
-    int8_t refcount;
+    int16_t refcount;
 } physical_pageinfo;
 
 static physical_pageinfo pageinfo[PAGENUMBER(MEMSIZE_PHYSICAL)];
@@ -66,6 +226,123 @@ typedef enum pageowner {
 static void pageinfo_init(void);
 
 
+// PHYSICAL PAGE ALLOCATOR
+//
+//    Free physical pages are tracked in a bitmap: bit `pn % 64` of
+//    `page_free_bits[pn / 64]` is set iff page `pn` is free. Bit `w` of
+//    `page_free_words` is set iff `page_free_bits[w]` has any bit set, so
+//    finding the lowest free page takes two find-first-set instructions,
+//    however much memory is in use.
+//
+//    Every change of `pageinfo[pn].refcount` between zero and nonzero
+//    must go through page_alloc(), page_free() or assign_physical_page(),
+//    which keep the bitmap in sync.
+
+#define PAGE_BITMAP_WORDS (NPAGES / 64)
+_Static_assert(NPAGES % 64 == 0 && PAGE_BITMAP_WORDS <= 64,
+               "free page bitmap summary must fit in one word");
+
+static uint64_t page_free_bits[PAGE_BITMAP_WORDS];
+static uint64_t page_free_words;
+static unsigned page_nfree;             // number of bits set
+
+static inline void page_mark_free(int pn) {
+    page_free_bits[pn / 64] |= 1UL << (pn % 64);
+    page_free_words |= 1UL << (pn / 64);
+    ++page_nfree;
+}
+
+static inline void page_mark_used(int pn) {
+    --page_nfree;
+    page_free_bits[pn / 64] &= ~(1UL << (pn % 64));
+    if (page_free_bits[pn / 64] == 0) {
+        page_free_words &= ~(1UL << (pn / 64));
+    }
+}
+
+
+// DEMAND-ZERO PAGES
+//
+//    With LAZY_ALLOC, sys_page_alloc only records the page in the
+//    process's `lazy_pages` bitmap (one bit per page at or above
+//    PROC_START_ADDR); the first access faults, and the fault handler
+//    allocates, zeroes and maps the page. In either mode, a fault on an
+//    unmapped page near %rsp within PROC_STACK_MAXSIZE of the top of
+//    memory grows the stack the same way.
+//
+//    Kernel cycles spent on page allocation -- whole traps, from
+//    exception() entry to the end of the handler -- are summed in
+//    `alloc_cycles` and logged per page every 64 pages. All CPUs update
+//    these counters with atomic instructions.
+
+#define PROC_STACK_MAXSIZE 0x10000
+#define LAZY_WORDS ((MEMSIZE_VIRTUAL - PROC_START_ADDR) / PAGESIZE / 64)
+
+static uint64_t lazy_pages[NPROC][LAZY_WORDS];
+static unsigned alloc_npages;           // pages allocated so far
+static uint64_t alloc_cycles;           // kernel cycles spent on them
+
+static int range_unmapped(proc* p, uintptr_t va, size_t npages);
+static int map_zero_page(proc* p, uintptr_t va);
+static size_t map_zero_range(proc* p, uintptr_t va, size_t npages,
+                             int flags);
+static int demand_zero(proc* p, uintptr_t addr);
+static void account_page_alloc(uint64_t trap_start, int npages);
+
+// MEMORY DISPLAY DIRTY TRACKING
+//
+//    The memory display repaints only cells that changed. mark_page_dirty()
+//    records that a physical page's owner or refcount changed, once for
+//    each of the two pictures that show it; mark_va_dirty() records that a
+//    process's mapping of a virtual page changed; and mark_vm_dirty_all()
+//    marks a whole new address space. Full redraws, timed separately from
+//    incremental ones in `memshow_cycles`, still happen periodically.
+
+#define VM_DIRTY_WORDS (MEMSIZE_VIRTUAL / PAGESIZE / 64)
+
+static uint64_t pm_dirty[PAGE_BITMAP_WORDS];     // for memshow_physical
+static uint64_t vm_pm_dirty[PAGE_BITMAP_WORDS];  // for memshow_virtual_animate
+static uint64_t vm_dirty[NPROC][VM_DIRTY_WORDS];
+static uint64_t memshow_cycles[2];      // [1]: full redraws
+static unsigned memshow_count[2];
+
+static inline void mark_page_dirty(int pn) {
+    pm_dirty[pn / 64] |= 1UL << (pn % 64);
+    vm_pm_dirty[pn / 64] |= 1UL << (pn % 64);
+}
+
+static inline void mark_va_dirty(pid_t pid, uintptr_t va) {
+    int i = PAGENUMBER(va);
+    vm_dirty[pid][i / 64] |= 1UL << (i % 64);
+}
+
+static inline void mark_vm_dirty_all(pid_t pid) {
+    memset(vm_dirty[pid], 0xFF, sizeof(vm_dirty[pid]));
+}
+
+// Cycles spent per user exception on invariant checks and the memory
+// display, logged once a second.
+static uint64_t exception_check_cycles;
+static unsigned exception_check_count;
+
+// EXCEPTION STATISTICS
+//
+//    exception() notes the entry time of each user exception in its CPU's
+//    cpustate, and run() charges the cycles up to the return to user mode
+//    to that interrupt number's `exception_stats` (lib.h), which
+//    sys_getstats copies out. System calls, page faults, and timer
+//    interrupts are tracked, on all CPUs together.
+
+#define NSTATS 18
+
+static exception_stats int_stats[NSTATS];
+static spinlock stats_lock;
+
+static exception_stats* stats_for(int intno);
+static void stats_record(exception_stats* st, uint64_t cycles);
+static int copy_to_user(proc* p, uintptr_t va, const void* src, size_t n);
+
+
 // Memory functions
 
 void check_virtual_memory(void);
@@ -82,15 +359,37 @@ void memdump_physical(void);
 //    string is an optional string passed from the boot loader.
 
 static void process_setup(pid_t pid, int program_number);
+static void memory_benchmark(void);
+static int pagetable_free(x86_64_pagetable* pt, int level, uintptr_t va,
+                          pid_t owner);
 
 void kernel(const char* command) {
     hardware_init();
     pageinfo_init();
     console_clear();
+    ticks = 0;
     timer_init(HZ);
 
-    // Set up process descriptors
+    // Set up process descriptors and per-CPU state. (A soft reboot may
+    // have stopped another CPU holding a lock.)
+    spinlock_init(&proc_lock);
+    spinlock_init(&page_lock);
+    spinlock_init(&stats_lock);
+    spinlock_init(&profile_lock);
     memset(processes, 0, sizeof(processes));
+    memset(cpus, 0, sizeof(cpus));
+    for (int i = 0; i < NCPU; ++i) {
+        cpus[i].cpu_index = i;
+        spinlock_init(&cpus[i].cpu_lock);
+    }
+    ncpu = 1;
+    sleepq_head = NULL;
+    memset(int_stats, 0, sizeof(int_stats));
+    memset(shm_regions, 0, sizeof(shm_regions));
+    memset(shm_held, 0, sizeof(shm_held));
+    memset(shm_mapped, 0, sizeof(shm_mapped));
+    futexq_head = NULL;
+    text_cache_init();
     for (pid_t i = 0; i < NPROC; i++) {
         processes[i].p_pid = i;
         processes[i].p_state = P_FREE;
@@ -114,55 +413,126 @@ void kernel(const char* command) {
         process_setup(1, 4);
     } else if (command && strcmp(command, "forkexit") == 0) {
         process_setup(1, 5);
+    } else if (command && strcmp(command, "pagebench") == 0) {
+        process_setup(1, 6);
+    } else if (command && strcmp(command, "forkstress") == 0) {
+        process_setup(1, 7);
+    } else if (command && strcmp(command, "syscallbench") == 0) {
+        process_setup(1, 8);
+    } else if (command && strcmp(command, "latency") == 0) {
+        process_setup(1, 9);
+    } else if (command && strcmp(command, "pingpong") == 0) {
+        process_setup(1, 10);
+    } else if (command && strcmp(command, "sametext") == 0) {
+        // four instances of one program, sharing its text pages
+        for (pid_t i = 1; i <= 4; ++i) {
+            process_setup(i, 0);
+        }
     } else {
+        if (command && strcmp(command, "membench") == 0) {
+            memory_benchmark();
+        }
         for (pid_t i = 1; i <= 4; ++i) {
             process_setup(i, i - 1);
         }
     }
 #endif
-    
-    // Switch to the first process using run()
-    run(&processes[1]);
+
+    // Start the other CPUs, which steal processes from this CPU's run
+    // queue, and start running processes here too
+    ncpu = cpus_start();
+    log_printf("smp: %d CPUs running\n", ncpu);
+    schedule();
 }
 
-static x86_64_pagetable* pagetable_allocator(void) {
-    for (int pn = 0; pn < NPAGES; pn++) {
-        if (pageinfo[pn].refcount == 0) {
-            pageinfo[pn].refcount = 1;
-            pageinfo[pn].owner = current_pt_owner;
 
-            void* pa = (void*) PAGEADDRESS(pn);
-            memset(pa, 0, PAGESIZE);
-            return (x86_64_pagetable*) pa;
-        }
+// memory_benchmark
+//    Times the kernel's memory primitives on two scratch pages with the
+//    cycle counter, against a plain byte loop, and logs cycles per call
+//    to `log.txt`. Run by command "membench" (or 'm' at the console)
+//    before the allocator programs start.
+
+#define MEMBENCH_ROUNDS 256
+
+#define MEMBENCH(name, stmt) do {                                       \
+        uint64_t t0_ = read_cycle_counter();                            \
+        for (int r_ = 0; r_ < MEMBENCH_ROUNDS; ++r_) {                  \
+            stmt;                                                       \
+        }                                                               \
+        uint64_t c_ = (read_cycle_counter() - t0_) / MEMBENCH_ROUNDS;   \
+        log_printf("membench: %-22s %6lu cycles\n", name, c_);          \
+    } while (0)
+
+static void byte_copy(char* dst, const char* src, size_t n) {
+    for (; n > 0; --n) {
+        *dst++ = *src++;
     }
-    return NULL;
+}
+
+static void memory_benchmark(void) {
+    uintptr_t a = page_alloc(PO_KERNEL);
+    uintptr_t b = page_alloc(PO_KERNEL);
+    assert(a && b);
+    char* pa = (char*) a;
+    char* pb = (char*) b;
+
+    MEMBENCH("byte loop copy 4096", byte_copy(pa, pb, PAGESIZE));
+    MEMBENCH("memset 4096", memset(pa, 0, PAGESIZE));
+    MEMBENCH("page_zero", page_zero(pa));
+    MEMBENCH("memcpy 4096", memcpy(pa, pb, PAGESIZE));
+    MEMBENCH("page_copy", page_copy(pa, pb));
+    MEMBENCH("memcpy 200", memcpy(pa, pb, 200));
+    MEMBENCH("memcpy 4000 misaligned", memcpy(pa + 1, pb + 2, 4000));
+    MEMBENCH("memmove 4000 overlap", memmove(pa + 8, pa, 4000));
+
+    page_free(a);
+    page_free(b);
+}
+
+static x86_64_pagetable* pagetable_allocator(void) {
+    uintptr_t pa = page_alloc(current_pt_owner);
+    if (!pa) {
+        return NULL;
+    }
+    page_zero((void*) pa);
+    return (x86_64_pagetable*) pa;
 }
 
 // --------------------------------------------------
 // copy_pagetable (Step 2 requirement)
 // --------------------------------------------------
+//    Returns a new page table, owned by `owner`, with the kernel mappings
+//    of `src`, or NULL if page-table pages run out.
 
 x86_64_pagetable* copy_pagetable(x86_64_pagetable* src, int8_t owner) {
     current_pt_owner = owner;
 
     // Allocate L1 root
     x86_64_pagetable* dst = pagetable_allocator();
-    assert(dst != NULL);
-
-    // Copy ONLY kernel mappings
-    for (uintptr_t va = 0; va < PROC_START_ADDR; va += PAGESIZE) {
-        vamapping m = virtual_memory_lookup(src, va);
+    if (!dst) {
+        return NULL;
+    }
 
-        if (m.pn >= 0) {
-            // Map into new pagetable
-            int r = virtual_memory_map(dst,
-                                       va,
-                                       PAGEADDRESS(m.pn),
-                                       PAGESIZE,
-                                       m.perm,
-                                       pagetable_allocator);
-            assert(r == 0);
+    // Copy ONLY kernel mappings, one virtual_memory_map() per run of
+    // contiguous pages with equal permissions
+    vmiter it;
+    virtual_memory_iter_init(&it, src, 0, PROC_START_ADDR);
+    int more = virtual_memory_iter_next(&it);
+    while (more) {
+        uintptr_t va = it.va, pa = it.map.pa;
+        int perm = it.map.perm;
+        size_t sz = 0;
+        do {
+            sz += PAGESIZE;
+            more = virtual_memory_iter_next(&it);
+        } while (more && it.va == va + sz && it.map.pa == pa + sz
+                 && it.map.perm == perm);
+
+        // Map into new pagetable
+        if (virtual_memory_map(dst, va, pa, sz, perm,
+                               pagetable_allocator) < 0) {
+            pagetable_free(dst, 0, 0, owner);
+            return NULL;
         }
     }
 
@@ -173,18 +543,28 @@ x86_64_pagetable* copy_pagetable(x86_64_pagetable* src, int8_t owner) {
 //    Load application program `program_number` as process number `pid`.
 //    This loads the application's code and data into memory, sets its
 //    %rip and %rsp, gives it a stack page, and marks it as runnable.
+//    Logs the pages and cycles it took, and the cycles spent loading.
 
 void process_setup(pid_t pid, int program_number) {
+    uint64_t t0 = read_cycle_counter();
+    unsigned nfree = page_nfree;
     process_init(&processes[pid], 0);
 
     // Allocate & copy kernel mappings
     x86_64_pagetable* pt = copy_pagetable(kernel_pagetable, pid);
+    assert(pt != NULL);
     processes[pid].p_pagetable = pt;
 
+    memset(lazy_pages[pid], 0, sizeof(lazy_pages[pid]));
+    mark_vm_dirty_all(pid);
+
     // Load program code + data > PROC_START_ADDR
     current_pt_owner = pid;
+    uint64_t load_start = read_cycle_counter();
     int r = program_load(&processes[pid], program_number, pagetable_allocator);
     assert(r >= 0);
+    uint64_t load_cycles = read_cycle_counter() - load_start;
+    processes[pid].p_program = program_number;
 
     // Allocate one stack page
     //uintptr_t rsp = PROC_START_ADDR + pid * PROC_SIZE;
@@ -192,27 +572,22 @@ void process_setup(pid_t pid, int program_number) {
     processes[pid].p_registers.reg_rsp = rsp;
     uintptr_t stack_va = rsp - PAGESIZE;
 
-    int spn = -1;
-    for (int pn = 0; pn < NPAGES; pn++) {
-        if (pageinfo[pn].refcount == 0) {
-            spn = pn;
-            break;
-        }
-    }
-    assert(spn >= 0);
-
-    pageinfo[spn].refcount = 1;
-    pageinfo[spn].owner = pid;
-    memset((void*) PAGEADDRESS(spn), 0, PAGESIZE);
+    uintptr_t stack_pa = page_alloc(pid);
+    assert(stack_pa != 0);
+    page_zero((void*) stack_pa);
 
     virtual_memory_map(pt,
                        stack_va,
-                       PAGEADDRESS(spn),
+                       stack_pa,
                        PAGESIZE,
                        PTE_P | PTE_W | PTE_U,
                        pagetable_allocator);
 
     processes[pid].p_state = P_RUNNABLE;
+    sched_admit(&processes[pid], STRIDE1 / (STRIDE_SCHED ? pid : 1));
+    log_printf("process_setup(pid %d): program %d, %u pages, "
+               "%lu cycles (%lu loading)\n", pid, program_number,
+               nfree - page_nfree, read_cycle_counter() - t0, load_cycles);
 }
 
 
@@ -229,8 +604,552 @@ int assign_physical_page(uintptr_t addr, int8_t owner) {
     } else {
         pageinfo[PAGENUMBER(addr)].refcount = 1;
         pageinfo[PAGENUMBER(addr)].owner = owner;
+        page_mark_used(PAGENUMBER(addr));
+        mark_page_dirty(PAGENUMBER(addr));
+        return 0;
+    }
+}
+
+
+// page_alloc(owner)
+//    Allocates the lowest-addressed free physical page to `owner` with
+//    reference count 1 and returns its physical address, or 0 if no
+//    page is free. The page's contents are not cleared.
+
+uintptr_t page_alloc(int8_t owner) {
+    if (page_free_words == 0) {
+        return 0;
+    }
+    int w = __builtin_ctzl(page_free_words);
+    int pn = w * 64 + __builtin_ctzl(page_free_bits[w]);
+    page_mark_used(pn);
+    assert(pageinfo[pn].refcount == 0);
+    pageinfo[pn].refcount = 1;
+    pageinfo[pn].owner = owner;
+    mark_page_dirty(pn);
+    return PAGEADDRESS(pn);
+}
+
+
+// page_alloc_many(owner, pas, n)
+//    Allocates up to `n` pages to `owner` as page_alloc() would, lowest-
+//    addressed first, taking them a bitmap word at a time. Stores their
+//    physical addresses in `pas[]` and returns how many were allocated.
+
+static size_t page_alloc_many(int8_t owner, uintptr_t* pas, size_t n) {
+    size_t k = 0;
+    while (k < n && page_free_words) {
+        int w = __builtin_ctzl(page_free_words);
+        uint64_t bits = page_free_bits[w];
+        for (; k < n && bits; bits &= bits - 1) {
+            int pn = w * 64 + __builtin_ctzl(bits);
+            assert(pageinfo[pn].refcount == 0);
+            pageinfo[pn].refcount = 1;
+            pageinfo[pn].owner = owner;
+            mark_page_dirty(pn);
+            --page_nfree;
+            pas[k++] = PAGEADDRESS(pn);
+        }
+        page_free_bits[w] = bits;
+        if (!bits) {
+            page_free_words &= ~(1UL << w);
+        }
+    }
+    return k;
+}
+
+
+// COPY-ON-WRITE
+//
+//    Fork shares every user page with the child: writable pages lose
+//    PTE_W and gain PTE_COW in both page tables, and each shared page's
+//    refcount counts the page tables that map it. A write fault on a
+//    PTE_COW page copies it, or just makes it writable again if no other
+//    page table still shares it.
+
+static unsigned cow_pages_shared;       // pages shared by fork so far
+static unsigned cow_pages_copied;       // pages copied on write so far
+
+static int copy_on_write(proc* p, uintptr_t va);
+
+
+
+// page_free(addr)
+//    Drops one reference to the physical page at `addr`. The page
+//    becomes free when its last reference is dropped.
+
+void page_free(uintptr_t addr) {
+    int pn = PAGENUMBER(addr);
+    assert(addr < MEMSIZE_PHYSICAL && PAGEOFFSET(addr) == 0);
+    assert(pageinfo[pn].refcount > 0);
+    mark_page_dirty(pn);
+    if (--pageinfo[pn].refcount == 0) {
+        pageinfo[pn].owner = PO_FREE;
+        page_mark_free(pn);
+        text_cache_evict(addr);
+    }
+}
+
+
+// page_ref(addr)
+//    Adds a reference to the allocated physical page at `addr`.
+
+void page_ref(uintptr_t addr) {
+    int pn = PAGENUMBER(addr);
+    assert(addr < MEMSIZE_PHYSICAL && PAGEOFFSET(addr) == 0);
+    assert(pageinfo[pn].refcount > 0);
+    ++pageinfo[pn].refcount;
+    mark_page_dirty(pn);
+}
+
+
+// copy_on_write(p, addr)
+//    Handles a write fault by process `p` at `addr`. If `addr` is on a
+//    PTE_COW page, gives `p` a private writable copy of the page and
+//    returns 0. Returns -1 if the page is not copy-on-write or no
+//    physical page is free. The copy is made without `page_lock`.
+
+static int copy_on_write(proc* p, uintptr_t addr) {
+    uintptr_t va = ROUNDDOWN(addr, PAGESIZE);
+    vamapping m = virtual_memory_lookup(p->p_pagetable, va);
+    if (m.pn < 0 || !(m.perm & PTE_COW) || !(m.perm & PTE_U)) {
+        return -1;
+    }
+    int perm = (m.perm & ~PTE_COW) | PTE_W;
+
+    spinlock_lock(&page_lock);
+    mark_va_dirty(p->p_pid, va);
+    if (pageinfo[m.pn].refcount == 1) {
+        // every other sharer has copied the page already: take it over
+        pageinfo[m.pn].owner = p->p_pid;
+        mark_page_dirty(m.pn);
+        int r = virtual_memory_map(p->p_pagetable, va, PAGEADDRESS(m.pn),
+                                   PAGESIZE, perm, NULL);
+        spinlock_unlock(&page_lock);
+        return r;
+    }
+    uintptr_t pa = page_alloc(p->p_pid);
+    spinlock_unlock(&page_lock);
+    if (!pa) {
+        return -1;
+    }
+
+    // `p`'s reference keeps the shared page alive while it is copied
+    page_copy((void*) pa, (void*) PAGEADDRESS(m.pn));
+
+    spinlock_lock(&page_lock);
+    int r = virtual_memory_map(p->p_pagetable, va, pa, PAGESIZE, perm, NULL);
+    assert(r == 0);
+    page_free(PAGEADDRESS(m.pn));
+    ++cow_pages_copied;
+    spinlock_unlock(&page_lock);
+    return 0;
+}
+
+
+// range_unmapped(p, va, npages)
+//    Returns 1 if none of the `npages` pages from `va` is mapped in `p`'s
+//    page table, 0 otherwise. Mapping a new page over an existing one
+//    would lose the old page's reference.
+
+static int range_unmapped(proc* p, uintptr_t va, size_t npages) {
+    vmiter it;
+    virtual_memory_iter_init(&it, p->p_pagetable, va, va + npages * PAGESIZE);
+    return !virtual_memory_iter_next(&it);
+}
+
+
+// map_zero_page(p, va)
+//    Maps a newly allocated, zeroed, writable page at `va` in `p`'s page
+//    table. Returns 0 on success and -1 if something is already mapped
+//    at `va` or physical memory is exhausted. The page is zeroed without
+//    `page_lock`, so CPUs allocating at once zero their pages in parallel.
+
+static int map_zero_page(proc* p, uintptr_t va) {
+    if (!range_unmapped(p, va, 1)) {
+        return -1;
+    }
+    spinlock_lock(&page_lock);
+    uintptr_t pa = page_alloc(p->p_pid);
+    spinlock_unlock(&page_lock);
+    if (!pa) {
+        return -1;
+    }
+    page_zero((void*) pa);
+
+    spinlock_lock(&page_lock);
+    current_pt_owner = p->p_pid;
+    int r = virtual_memory_map(p->p_pagetable, va, pa, PAGESIZE,
+                               PTE_P | PTE_W | PTE_U, pagetable_allocator);
+    if (r < 0) {
+        page_free(pa);
+    } else {
+        mark_va_dirty(p->p_pid, va);
+    }
+    spinlock_unlock(&page_lock);
+    return r;
+}
+
+
+// map_zero_range(p, va, npages, flags)
+//    Maps `npages` newly allocated, zeroed, writable pages from `va` up in
+//    `p`'s page table, which must have nothing mapped there, allocating
+//    and mapping them MAP_RANGE_BATCH at a time (and zeroing each batch
+//    without `page_lock`). Returns the number mapped, which is less than
+//    `npages` if memory ran out. With PAGE_ALLOC_ALL, a partial range is
+//    unmapped and freed again and 0 is returned.
+
+#define MAP_RANGE_BATCH 64
+
+static size_t map_zero_range(proc* p, uintptr_t va, size_t npages,
+                             int flags) {
+    uintptr_t pas[MAP_RANGE_BATCH];
+    size_t done = 0;
+    while (done < npages) {
+        size_t want = MIN(npages - done, (size_t) MAP_RANGE_BATCH);
+        spinlock_lock(&page_lock);
+        size_t n = page_alloc_many(p->p_pid, pas, want);
+        spinlock_unlock(&page_lock);
+        for (size_t i = 0; i < n; ++i) {
+            page_zero((void*) pas[i]);
+        }
+        spinlock_lock(&page_lock);
+        current_pt_owner = p->p_pid;
+        size_t m = virtual_memory_map_pages(p->p_pagetable,
+                                            va + done * PAGESIZE, pas, n,
+                                            PTE_P | PTE_W | PTE_U,
+                                            pagetable_allocator);
+        for (size_t i = m; i < n; ++i) {
+            page_free(pas[i]);
+        }
+        for (size_t i = 0; i < m; ++i) {
+            mark_va_dirty(p->p_pid, va + (done + i) * PAGESIZE);
+        }
+        spinlock_unlock(&page_lock);
+        done += m;
+        if (m < want) {
+            break;
+        }
+    }
+
+    if ((flags & PAGE_ALLOC_ALL) && done < npages) {
+        spinlock_lock(&page_lock);
+        for (size_t i = 0; i < done; ++i) {
+            vamapping m = virtual_memory_lookup(p->p_pagetable,
+                                                va + i * PAGESIZE);
+            page_free(PAGEADDRESS(m.pn));
+        }
+        virtual_memory_map(p->p_pagetable, va, 0, done * PAGESIZE, 0, NULL);
+        spinlock_unlock(&page_lock);
+        done = 0;
+    }
+    return done;
+}
+
+
+// demand_zero(p, addr)
+//    Handles a fault by process `p` on unmapped address `addr`. If `addr`
+//    is on a page `p` allocated lazily, or just below its stack, maps a
+//    zeroed page there and returns 0. Otherwise returns -1.
+
+static int demand_zero(proc* p, uintptr_t addr) {
+    uintptr_t va = ROUNDDOWN(addr, PAGESIZE);
+    if (va < PROC_START_ADDR || va >= MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+
+    int i = (va - PROC_START_ADDR) / PAGESIZE;
+    uint64_t bit = 1UL << (i % 64);
+    if (lazy_pages[p->p_pid][i / 64] & bit) {
+        if (map_zero_page(p, va) < 0) {
+            return -1;
+        }
+        lazy_pages[p->p_pid][i / 64] &= ~bit;
+        return 0;
+    }
+
+    // grow the stack, but only for accesses near %rsp (push, call)
+    if (va >= MEMSIZE_VIRTUAL - PROC_STACK_MAXSIZE
+        && addr + 256 >= p->p_registers.reg_rsp) {
+        return map_zero_page(p, va);
+    }
+    return -1;
+}
+
+
+// copy_to_user(p, va, src, n)
+//    Copies `n` bytes from kernel memory `src` to virtual address `va` in
+//    process `p`, faulting in lazily allocated and copy-on-write pages as a
+//    write by `p` would. Returns 0 on success and -1 if the destination is
+//    not writable user memory.
+
+static int copy_to_user(proc* p, uintptr_t va, const void* src, size_t n) {
+    const char* s = (const char*) src;
+    if (va + n < va) {
+        return -1;
+    }
+    while (n > 0) {
+        vamapping m = virtual_memory_lookup(p->p_pagetable, va);
+        if ((m.pn < 0 && demand_zero(p, va) == 0)
+            || ((m.perm & PTE_COW) && copy_on_write(p, va) == 0)) {
+            m = virtual_memory_lookup(p->p_pagetable, va);
+        }
+        if (m.pn < 0
+            || (m.perm & (PTE_P | PTE_W | PTE_U)) != (PTE_P | PTE_W | PTE_U)) {
+            return -1;
+        }
+        size_t k = MIN(n, PAGESIZE - va % PAGESIZE);
+        memcpy((void*) (PAGEADDRESS(m.pn) + va % PAGESIZE), s, k);
+        va += k, s += k, n -= k;
+    }
+    return 0;
+}
+
+
+// shm_create(p, npages)
+//    Creates a shared memory region of `npages` zeroed pages held by `p`.
+//    Returns its ID, or -1 if out of regions or memory.
+
+static int shm_create(proc* p, size_t npages) {
+    if (npages == 0 || npages > SHM_MAXPAGES) {
+        return -1;
+    }
+    spinlock_lock(&page_lock);
+    int id = 0;
+    while (id < NSHM && shm_regions[id].npages) {
+        ++id;
+    }
+    if (id == NSHM) {
+        spinlock_unlock(&page_lock);
+        return -1;
+    }
+
+    shm_region* r = &shm_regions[id];
+    size_t n = page_alloc_many(p->p_pid, r->pas, npages);
+    for (size_t i = 0; i < n; ++i) {
+        if (n < npages) {
+            page_free(r->pas[i]);
+        } else {
+            page_zero((void*) r->pas[i]);
+        }
+    }
+    if (n == npages) {
+        r->npages = npages;
+        r->nholders = 1;
+        shm_held[p->p_pid] |= 1 << id;
+    }
+    spinlock_unlock(&page_lock);
+    return n == npages ? id : -1;
+}
+
+
+// shm_map(p, id, va)
+//    Maps shared memory region `id` at `va` in `p`, which must have
+//    nothing mapped there. Returns 0 on success and -1 on failure.
+//    shm_map_locked() does the work with `page_lock` held.
+
+static int shm_map_locked(proc* p, int id, uintptr_t va);
+
+static int shm_map(proc* p, int id, uintptr_t va) {
+    if (id < 0 || id >= NSHM) {
+        return -1;
+    }
+    spinlock_lock(&page_lock);
+    int r = shm_map_locked(p, id, va);
+    spinlock_unlock(&page_lock);
+    return r;
+}
+
+static int shm_map_locked(proc* p, int id, uintptr_t va) {
+    shm_region* r = &shm_regions[id];
+    if (!r->npages || (shm_mapped[p->p_pid] & (1 << id))
+        || va % PAGESIZE != 0 || va < PROC_START_ADDR || va > MEMSIZE_VIRTUAL
+        || r->npages > (MEMSIZE_VIRTUAL - va) / PAGESIZE) {
+        return -1;
+    }
+    if (!range_unmapped(p, va, r->npages)) {
+        return -1;
+    }
+
+    current_pt_owner = p->p_pid;
+    size_t m = virtual_memory_map_pages(p->p_pagetable, va, r->pas,
+                                        r->npages,
+                                        PTE_P | PTE_W | PTE_U | PTE_SHARED,
+                                        pagetable_allocator);
+    if (m < r->npages) {
+        virtual_memory_map(p->p_pagetable, va, 0, m * PAGESIZE, 0, NULL);
+        return -1;
+    }
+    for (size_t i = 0; i < r->npages; ++i) {
+        ++pageinfo[PAGENUMBER(r->pas[i])].refcount;
+        mark_page_dirty(PAGENUMBER(r->pas[i]));
+        mark_va_dirty(p->p_pid, va + i * PAGESIZE);
+    }
+    shm_mapped[p->p_pid] |= 1 << id;
+    if (!(shm_held[p->p_pid] & (1 << id))) {
+        shm_held[p->p_pid] |= 1 << id;
+        ++r->nholders;
+    }
+    return 0;
+}
+
+
+// shm_inherit(child, parent)
+//    Makes forked process `child` a holder of `parent`'s regions, mapping
+//    the ones `parent` maps.
+
+static void shm_inherit(proc* child, proc* parent) {
+    shm_held[child->p_pid] = shm_held[parent->p_pid];
+    shm_mapped[child->p_pid] = shm_mapped[parent->p_pid];
+    for (int id = 0; id < NSHM; ++id) {
+        if (shm_held[child->p_pid] & (1 << id)) {
+            ++shm_regions[id].nholders;
+        }
+    }
+}
+
+
+// shm_release(p)
+//    Drops exiting process `p`'s holds. Frees the region references of
+//    regions with no holders left, and hands `p`'s pages in the others to
+//    another holder.
+
+static void shm_release(proc* p) {
+    pid_t pid = p->p_pid;
+    shm_mapped[pid] = 0;
+    for (int id = 0; id < NSHM && shm_held[pid]; ++id) {
+        if (!(shm_held[pid] & (1 << id))) {
+            continue;
+        }
+        shm_held[pid] &= ~(1 << id);
+        shm_region* r = &shm_regions[id];
+        if (--r->nholders == 0) {
+            for (size_t i = 0; i < r->npages; ++i) {
+                page_free(r->pas[i]);
+            }
+            r->npages = 0;
+            continue;
+        }
+        pid_t heir = 1;
+        while (!(shm_held[heir] & (1 << id))) {
+            ++heir;
+        }
+        for (size_t i = 0; i < r->npages; ++i) {
+            int pn = PAGENUMBER(r->pas[i]);
+            if (pageinfo[pn].owner == pid) {
+                pageinfo[pn].owner = heir;
+                mark_page_dirty(pn);
+            }
+        }
+    }
+}
+
+
+// futex_address(p, va)
+//    Returns the physical address of the int at `va` in `p`, or 0 if `va`
+//    is misaligned or not in a shared memory region (PTE_SHARED).
+
+static uintptr_t futex_address(proc* p, uintptr_t va) {
+    vamapping m = virtual_memory_lookup(p->p_pagetable, va);
+    if (va % sizeof(int) != 0 || m.pn < 0 || !(m.perm & PTE_U)
+        || !(m.perm & PTE_SHARED)) {
         return 0;
     }
+    return PAGEADDRESS(m.pn) + va % PAGESIZE;
+}
+
+
+// account_page_alloc(trap_start, npages)
+//    Charges the current trap, which entered the kernel at cycle
+//    `trap_start`, to page allocation, counting `npages` pages.
+
+static void account_page_alloc(uint64_t trap_start, int npages) {
+    uint64_t cycles = read_cycle_counter() - trap_start;
+    cycles += __atomic_fetch_add(&alloc_cycles, cycles, __ATOMIC_RELAXED);
+    for (int i = 0; i < npages; ++i) {
+        unsigned n = __atomic_add_fetch(&alloc_npages, 1, __ATOMIC_RELAXED);
+        if (n % 64 == 0) {
+            log_printf("page_alloc (%s): %u pages, %lu kernel cycles/page\n",
+                       LAZY_ALLOC ? "lazy" : "eager", n, cycles / n);
+        }
+    }
+}
+
+
+// pagetable_free(pt, level, va)
+//    Frees level-`level` page table `pt`, which maps the addresses from
+//    `va` on, and every page table below it, dropping one reference to
+//    each user page they map (kernel mappings below PROC_START_ADDR are
+//    skipped). Returns the number of those user pages, owned by `owner`,
+//    that other page tables still reference.
+
+static int pagetable_free(x86_64_pagetable* pt, int level, uintptr_t va,
+                          pid_t owner) {
+    int nshared = 0;
+    for (int i = 0; i < NPAGETABLEENTRIES; ++i) {
+        x86_64_pageentry_t pe = pt->entry[i];
+        if (!(pe & PTE_P)) {
+            continue;
+        }
+        uintptr_t entry_va = va + ((uintptr_t) i
+                                   << (PAGEOFFBITS + (3 - level) * PAGEINDEXBITS));
+        if (level < 3) {
+            nshared += pagetable_free((x86_64_pagetable*) PTE_ADDR(pe),
+                                      level + 1, entry_va, owner);
+        } else if (entry_va >= PROC_START_ADDR) {
+            int pn = PAGENUMBER(pe);
+            page_free(PTE_ADDR(pe));
+            nshared += pageinfo[pn].refcount > 0 && pageinfo[pn].owner == owner;
+        }
+    }
+    page_free((uintptr_t) pt);
+    return nshared;
+}
+
+
+// process_free(p)
+//    Frees process `p`'s memory and page tables and marks its slot free.
+//    User pages `p` owned that are still shared copy-on-write are handed
+//    to a process that maps them. `p` must not be on a run queue, and the
+//    caller must hold `proc_lock`.
+
+static unsigned sched_exits;            // processes exited so far
+
+static void process_free(proc* p) {
+    pid_t pid = p->p_pid;
+    int nshared = 0;
+    spinlock_lock(&page_lock);
+    shm_release(p);
+    if (p->p_pagetable != kernel_pagetable) {
+        nshared = pagetable_free(p->p_pagetable, 0, 0, pid);
+    }
+    p->p_pagetable = NULL;
+    p->p_state = P_FREE;
+    mark_vm_dirty_all(pid);
+    memset(lazy_pages[pid], 0, sizeof(lazy_pages[pid]));
+
+    for (pid_t q = 1; nshared > 0 && q < NPROC; ++q) {
+        if (processes[q].p_state == P_FREE) {
+            continue;
+        }
+        vmiter it;
+        virtual_memory_iter_init(&it, processes[q].p_pagetable,
+                                 PROC_START_ADDR, MEMSIZE_VIRTUAL);
+        while (virtual_memory_iter_next(&it)) {
+            if (pageinfo[it.map.pn].owner == pid) {
+                pageinfo[it.map.pn].owner = q;
+                mark_page_dirty(it.map.pn);
+                --nshared;
+            }
+        }
+    }
+
+    unsigned nfree = page_nfree;
+    spinlock_unlock(&page_lock);
+
+    if (++sched_exits % 256 == 0) {
+        log_printf("exit: %u exits, %u pages free\n", sched_exits, nfree);
+    }
 }
 
 
@@ -246,6 +1165,25 @@ int assign_physical_page(uintptr_t addr, int8_t owner) {
 //    Note that hardware interrupts are disabled whenever the kernel is running.
 
 void exception(x86_64_registers* reg) {
+    uint64_t trap_start = read_cycle_counter();
+    cpustate* c = this_cpu();
+
+    // A timer interrupt from the kernel arrived while schedule() idled.
+    // No process was running: count the tick (on CPU 0) and resume the
+    // idle loop.
+    if (reg->reg_intno == INT_TIMER && (reg->reg_cs & 3) == 0) {
+        profile_sample(reg);
+        if (c->cpu_index == 0) {
+            timer_tick();
+        } else {
+            lapic_eoi();
+        }
+        exception_return(reg);
+    }
+
+    c->cpu_trap_stats = stats_for(reg->reg_intno);
+    c->cpu_trap_start = trap_start;
+
     // Copy the saved registers into the `current` process descriptor
     // and always use the kernel's page table.
     current->p_registers = *reg;
@@ -256,27 +1194,41 @@ void exception(x86_64_registers* reg) {
     /*log_printf("proc %d: exception %d\n", current->p_pid, reg->reg_intno);*/
 
     // Show the current cursor location and memory state
-    // (unless this is a kernel fault).
-    console_show_cursor(cursorpos);
-    if (reg->reg_intno != INT_PAGEFAULT || (reg->reg_err & PFERR_USER)) {
+    // (unless this is a kernel fault). Only CPU 0 does this.
+    if (c->cpu_index == 0
+        && (reg->reg_intno != INT_PAGEFAULT || (reg->reg_err & PFERR_USER))) {
+        console_show_cursor(cursorpos);
+        spinlock_lock(&proc_lock);
+        spinlock_lock(&page_lock);
+#if FAST_EXCEPTIONS
+        if (reg->reg_intno == INT_TIMER) {
+            if (ticks % CHECK_TICKS == 0) {
+                check_virtual_memory();
+            }
+            if (ticks % DISPLAY_TICKS == 0) {
+                memshow_physical();
+                memshow_virtual_animate();
+            }
+        }
+#else
         check_virtual_memory();
         memshow_physical();
         memshow_virtual_animate();
-
-#if TICK_LIMIT
-	if (ticks == TICK_LIMIT) {
-	  poweroff();
-	}
-
-	if (reg->reg_intno == INT_TIMER && ticks % HZ == 0) {
-	  memdump_physical();
-	  memdump_virtual_all();
-	}
 #endif
+        spinlock_unlock(&page_lock);
+        spinlock_unlock(&proc_lock);
+        exception_check_cycles += read_cycle_counter() - trap_start;
+        ++exception_check_count;
     }
 
     // If Control-C was typed, exit the virtual machine.
+#if FAST_EXCEPTIONS
+    if (reg->reg_intno == INT_TIMER) {
+        check_keyboard();
+    }
+#else
     check_keyboard();
+#endif
 
 
     // Actually handle the exception.
@@ -294,54 +1246,199 @@ void exception(x86_64_registers* reg) {
         schedule();
         break;                  /* will not be reached */
 
-    case INT_SYS_PAGE_ALLOC: {
-        uintptr_t addr = current->p_registers.reg_rdi;
+    case INT_SYS_EXIT:
+        spinlock_lock(&proc_lock);
+        process_free(current);
+        current = NULL;
+        spinlock_unlock(&proc_lock);
+        schedule();
+        break;                  /* will not be reached */
 
-        // VA must be page-aligned
-        if (addr % PAGESIZE != 0) {
+    case INT_SYS_PAGE_ALLOC_RANGE: {
+        uintptr_t addr = current->p_registers.reg_rdi;
+        size_t npages = current->p_registers.reg_rsi;
+        int flags = current->p_registers.reg_rdx;
+        if (addr % PAGESIZE != 0
+            || addr < PROC_START_ADDR || addr > MEMSIZE_VIRTUAL
+            || npages > (MEMSIZE_VIRTUAL - addr) / PAGESIZE
+            || (flags & ~PAGE_ALLOC_ALL)
+            || !range_unmapped(current, addr, npages)) {
             current->p_registers.reg_rax = -1;
             break;
         }
 
-        // Find free physical page
-        int pn = -1;
-        for (int i = 0; i < NPAGES; i++) {
-            if (pageinfo[i].refcount == 0) {
-                pn = i;
-                break;
-            }
+#if LAZY_ALLOC
+        // As for INT_SYS_PAGE_ALLOC, only record the pages
+        spinlock_lock(&page_lock);
+        int full = page_free_words == 0
+            || ((flags & PAGE_ALLOC_ALL) && page_nfree < npages);
+        spinlock_unlock(&page_lock);
+        if (full) {
+            current->p_registers.reg_rax = 0;
+            break;
         }
-        if (pn < 0) {
+        for (size_t k = 0; k < npages; ++k) {
+            int i = (addr - PROC_START_ADDR) / PAGESIZE + k;
+            lazy_pages[current->p_pid][i / 64] |= 1UL << (i % 64);
+        }
+        account_page_alloc(trap_start, 0);
+        current->p_registers.reg_rax = npages;
+#else
+        size_t n = map_zero_range(current, addr, npages, flags);
+        account_page_alloc(trap_start, n);
+        current->p_registers.reg_rax = n;
+#endif
+        break;
+    }
+
+    case INT_SYS_SHM_CREATE:
+        current->p_registers.reg_rax =
+            shm_create(current, current->p_registers.reg_rdi);
+        break;
+
+    case INT_SYS_SHM_MAP:
+        current->p_registers.reg_rax =
+            shm_map(current, current->p_registers.reg_rdi,
+                    current->p_registers.reg_rsi);
+        break;
+
+    case INT_SYS_FUTEX_WAIT: {
+        // Check the word under `proc_lock`, so a waker that changes it
+        // and then calls sys_futex_wake cannot slip in between.
+        uintptr_t pa = futex_address(current, current->p_registers.reg_rdi);
+        spinlock_lock(&proc_lock);
+        if (!pa || *(int*) pa != (int) current->p_registers.reg_rsi) {
+            spinlock_unlock(&proc_lock);
             current->p_registers.reg_rax = -1;
             break;
         }
+        current->p_registers.reg_rax = 0;
+        current->p_state = P_BLOCKED;
+        current->p_futex = pa;
+        current->p_runq_next = NULL;
+        proc** pp = &futexq_head;
+        while (*pp) {
+            pp = &(*pp)->p_runq_next;
+        }
+        *pp = current;
+        current = NULL;
+        spinlock_unlock(&proc_lock);
+        schedule();
+        break;                  /* will not be reached */
+    }
 
-        uintptr_t pa = PAGEADDRESS(pn);
+    case INT_SYS_FUTEX_WAKE: {
+        uintptr_t pa = futex_address(current, current->p_registers.reg_rdi);
+        int n = current->p_registers.reg_rsi;
+        if (!pa) {
+            current->p_registers.reg_rax = -1;
+            break;
+        }
+        int nwoken = 0;
+        spinlock_lock(&proc_lock);
+        proc** pp = &futexq_head;
+        while (*pp && nwoken < n) {
+            proc* p = *pp;
+            if (p->p_futex == pa) {
+                *pp = p->p_runq_next;
+                sched_wake(p);
+                ++nwoken;
+            } else {
+                pp = &p->p_runq_next;
+            }
+        }
+        spinlock_unlock(&proc_lock);
+        current->p_registers.reg_rax = nwoken;
+        break;
+    }
 
-        // Mark page allocated
-        if (assign_physical_page(pa, current->p_pid) < 0) {
+    case INT_SYS_GETSTATS: {
+        exception_stats* st = stats_for(current->p_registers.reg_rdi);
+        if (!st) {
             current->p_registers.reg_rax = -1;
             break;
         }
+        spinlock_lock(&stats_lock);
+        exception_stats copy = *st;
+        spinlock_unlock(&stats_lock);
+        current->p_registers.reg_rax =
+            copy_to_user(current, current->p_registers.reg_rsi,
+                         &copy, sizeof(copy));
+        break;
+    }
 
-        // Zero new user data page
-        memset((void*) pa, 0, PAGESIZE);
+    case INT_SYS_SLEEP: {
+        unsigned nticks = current->p_registers.reg_rdi;
+        if (nticks > 0) {
+            spinlock_lock(&proc_lock);
+            current->p_state = P_BLOCKED;
+            current->p_wakeup = ticks + nticks;
+            sleepq_insert(current);
+            current = NULL;
+            spinlock_unlock(&proc_lock);
+        }
+        schedule();
+        break;                  /* will not be reached */
+    }
+
+    case INT_SYS_PAGE_ALLOC: {
+        uintptr_t addr = current->p_registers.reg_rdi;
 
-        // Map into user pagetable
-        int r = virtual_memory_map(
-                    current->p_pagetable,
-                    addr,
-                    pa,
-                    PAGESIZE,
-                    PTE_P | PTE_W | PTE_U,
-                    pagetable_allocator);
+        // VA must be page-aligned
+        if (addr % PAGESIZE != 0) {
+            current->p_registers.reg_rax = -1;
+            break;
+        }
 
+#if LAZY_ALLOC
+        // Only record the page; the first access faults it in. (Fail
+        // early if memory is already exhausted.)
+        spinlock_lock(&page_lock);
+        int full = page_free_words == 0;
+        spinlock_unlock(&page_lock);
+        if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL
+            || full || !range_unmapped(current, addr, 1)) {
+            current->p_registers.reg_rax = -1;
+            break;
+        }
+        int i = (addr - PROC_START_ADDR) / PAGESIZE;
+        lazy_pages[current->p_pid][i / 64] |= 1UL << (i % 64);
+        account_page_alloc(trap_start, 0);
+        current->p_registers.reg_rax = 0;
+#else
+        // Allocate, zero and map a physical page
+        int r = map_zero_page(current, addr);
+        if (r == 0) {
+            account_page_alloc(trap_start, 1);
+        }
         current->p_registers.reg_rax = r;
+#endif
         break;
     }
 
     case INT_TIMER:
-        ++ticks;
+        profile_sample(reg);
+        if (c->cpu_index != 0) {
+            lapic_eoi();
+            schedule();
+        }
+        timer_tick();
+        if (ticks % HZ == 0 && exception_check_count) {
+            log_printf("exception: %u traps, %lu cycles/trap in checks "
+                       "and display\n", exception_check_count,
+                       exception_check_cycles / exception_check_count);
+            exception_check_cycles = 0;
+            exception_check_count = 0;
+            if (memshow_count[0] && memshow_count[1]) {
+                log_printf("memshow: %lu cycles/incremental repaint, "
+                           "%lu cycles/full redraw\n",
+                           memshow_cycles[0] / memshow_count[0],
+                           memshow_cycles[1] / memshow_count[1]);
+            }
+        }
+        if (ticks % HZ == 0) {
+            sched_log();
+        }
         schedule();
         break;                  /* will not be reached */
 
@@ -357,15 +1454,30 @@ void exception(x86_64_registers* reg) {
             panic("Kernel page fault for %p (%s %s, rip=%p)!\n",
                   addr, operation, problem, reg->reg_rip);
         }
+        if ((reg->reg_err & (PFERR_WRITE | PFERR_PRESENT))
+                == (PFERR_WRITE | PFERR_PRESENT)
+            && copy_on_write(current, addr) == 0) {
+            break;
+        }
+        if (!(reg->reg_err & PFERR_PRESENT)
+            && demand_zero(current, addr) == 0) {
+            account_page_alloc(trap_start, 1);
+            break;
+        }
         console_printf(CPOS(24, 0), 0x0C00,
                        "Process %d page fault for %p (%s %s, rip=%p)!\n",
                        current->p_pid, addr, operation, problem, reg->reg_rip);
+        spinlock_lock(&proc_lock);
         current->p_state = P_BROKEN;
+        spinlock_unlock(&proc_lock);
         break;
     }
 
     case INT_SYS_FORK: {
-    // Find a free process slot
+    // Find a free process slot. `proc_lock` keeps the slot ours until the
+    // child is runnable; `page_lock` covers building its page table.
+    spinlock_lock(&proc_lock);
+    spinlock_lock(&page_lock);
     pid_t child = -1;
     for (pid_t p = 1; p < NPROC; p++) {
         if (processes[p].p_state == P_FREE) {
@@ -375,52 +1487,94 @@ void exception(x86_64_registers* reg) {
     }
 
     if (child < 0) {
+        spinlock_unlock(&page_lock);
+        spinlock_unlock(&proc_lock);
         current->p_registers.reg_rax = -1;
         break;
     }
+    uint64_t fork_start = read_cycle_counter();
+    unsigned nshared = 0;
 
     // Create a new pagetable for the child
     x86_64_pagetable* childpt = copy_pagetable(current->p_pagetable, child);
+    if (!childpt) {
+        spinlock_unlock(&page_lock);
+        spinlock_unlock(&proc_lock);
+        current->p_registers.reg_rax = -1;
+        break;
+    }
     processes[child].p_pagetable = childpt;
 
-    // Copy registers
-    processes[child].p_registers = current->p_registers;
-    processes[child].p_registers.reg_rax = 0;   // child returns 0
-
-    // Copy user memory pages (everything >= PROC_START_ADDR)
-    for (uintptr_t va = PROC_START_ADDR; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
-        vamapping m = virtual_memory_lookup(current->p_pagetable, va);
-
-        if (m.pn >= 0 && (m.perm & PTE_W)) {
-            // allocate new physical page
-            int newpn = -1;
-            for (int i = 0; i < NPAGES; i++) {
-                if (pageinfo[i].refcount == 0) {
-                    newpn = i;
-                    break;
-                }
+    // Share user memory pages (everything >= PROC_START_ADDR)
+    // copy-on-write. Only page-table pages are allocated, so running out
+    // of memory frees the partial child and fails the fork.
+    int failed = 0;
+    vmiter it;
+    virtual_memory_iter_init(&it, current->p_pagetable,
+                             PROC_START_ADDR, MEMSIZE_VIRTUAL);
+    while (virtual_memory_iter_next(&it)) {
+        uintptr_t va = it.va;
+        vamapping m = it.map;
+
+        if (m.perm & PTE_U) {
+            int perm = m.perm;
+            if ((perm & PTE_W) && !(perm & PTE_SHARED)) {
+                // write-protect the parent's mapping too
+                perm = (perm & ~PTE_W) | PTE_COW;
+                int r = virtual_memory_map(current->p_pagetable, va,
+                                           PAGEADDRESS(m.pn), PAGESIZE,
+                                           perm, NULL);
+                assert(r == 0);
+                mark_va_dirty(current->p_pid, va);
             }
-            assert(newpn >= 0);
 
-            uintptr_t newpa = PAGEADDRESS(newpn);
-            pageinfo[newpn].refcount = 1;
-            pageinfo[newpn].owner = child;
-
-            // copy data into new physical page
-            memcpy((void*) newpa, (void*) m.pa, PAGESIZE);
-
-            // map copied page into child's pagetable
-            virtual_memory_map(childpt,
-                               va,
-                               newpa,
-                               PAGESIZE,
-                               m.perm,
-                               pagetable_allocator);
+            // map shared page into child's pagetable
+            if (virtual_memory_map(childpt,
+                                   va,
+                                   PAGEADDRESS(m.pn),
+                                   PAGESIZE,
+                                   perm,
+                                   pagetable_allocator) < 0) {
+                failed = 1;
+                break;
+            }
+            ++pageinfo[m.pn].refcount;
+            mark_page_dirty(m.pn);
+            ++nshared;
         }
     }
+    if (failed) {
+        pagetable_free(childpt, 0, 0, child);
+        processes[child].p_pagetable = NULL;
+        processes[child].p_state = P_FREE;
+        spinlock_unlock(&page_lock);
+        spinlock_unlock(&proc_lock);
+        current->p_registers.reg_rax = -1;
+        break;
+    }
+
+    // Copy registers and pending lazy allocations
+    processes[child].p_registers = current->p_registers;
+    processes[child].p_program = current->p_program;
+    shm_inherit(&processes[child], current);
+    memcpy(lazy_pages[child], lazy_pages[current->p_pid],
+           sizeof(lazy_pages[child]));
+    processes[child].p_registers.reg_rax = 0;   // child returns 0
+    mark_vm_dirty_all(child);
+    cow_pages_shared += nshared;
+    unsigned total_shared = cow_pages_shared;
+    unsigned total_copied = cow_pages_copied;
+    spinlock_unlock(&page_lock);
 
     // Mark runnable
     processes[child].p_state = P_RUNNABLE;
+    sched_admit(&processes[child], current->p_stride);
+    spinlock_unlock(&proc_lock);
+
+    log_printf("fork: pid %d -> %d in %lu cycles, %u pages shared "
+               "(%u shared, %u copied on write so far)\n",
+               current->p_pid, child, read_cycle_counter() - fork_start,
+               nshared, total_shared, total_copied);
 
     // Parent returns child's pid
     current->p_registers.reg_rax = child;
@@ -443,19 +1597,360 @@ void exception(x86_64_registers* reg) {
 }
 
 
+// runq_push(c, p), runq_remove(c, p)
+//    Append `p` to the back of CPU `c`'s run queue, or unlink it from
+//    there. The caller must hold `c->cpu_lock`.
+
+static void runq_push(cpustate* c, proc* p) {
+    p->p_runq_next = NULL;
+    p->p_runq_prev = c->cpu_runq_tail;
+    if (c->cpu_runq_tail) {
+        c->cpu_runq_tail->p_runq_next = p;
+    } else {
+        c->cpu_runq_head = p;
+    }
+    c->cpu_runq_tail = p;
+}
+
+static void runq_remove(cpustate* c, proc* p) {
+    if (p->p_runq_prev) {
+        p->p_runq_prev->p_runq_next = p->p_runq_next;
+    } else {
+        c->cpu_runq_head = p->p_runq_next;
+    }
+    if (p->p_runq_next) {
+        p->p_runq_next->p_runq_prev = p->p_runq_prev;
+    } else {
+        c->cpu_runq_tail = p->p_runq_prev;
+    }
+    p->p_runq_next = p->p_runq_prev = NULL;
+}
+
+
+// runq_take(c, p)
+//    Charge a turn to process `p`, just taken off a run queue to run on
+//    CPU `c`.
+
+static void runq_take(cpustate* c, proc* p) {
+    c->cpu_pass = p->p_pass;
+    p->p_pass += p->p_stride;
+    __atomic_add_fetch(&p->p_nruns, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->cpu_nruns, 1, __ATOMIC_RELAXED);
+}
+
+
+// runq_pick(c)
+//    Remove and return the process CPU `c` should run next from its own
+//    run queue, or NULL if it is empty. The caller must hold
+//    `c->cpu_lock`.
+
+static proc* runq_pick(cpustate* c) {
+    proc* p = c->cpu_runq_head;
+#if STRIDE_SCHED
+    for (proc* q = c->cpu_runq_head; q; q = q->p_runq_next) {
+        if (q->p_pass < p->p_pass) {
+            p = q;
+        }
+    }
+#endif
+    if (p) {
+        runq_remove(c, p);
+        runq_take(c, p);
+    }
+    return p;
+}
+
+
+// runq_steal(c)
+//    Remove and return a process for idle CPU `c` from another CPU's run
+//    queue (the one queued last, which that CPU would run last), or NULL.
+//    The caller must not hold any `cpu_lock`.
+
+static proc* runq_steal(cpustate* c) {
+    for (int i = 1; i < ncpu; ++i) {
+        cpustate* victim = &cpus[(c->cpu_index + i) % ncpu];
+        if (!__atomic_load_n(&victim->cpu_runq_tail, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        spinlock_lock(&victim->cpu_lock);
+        proc* p = victim->cpu_runq_tail;
+        if (p) {
+            runq_remove(victim, p);
+        }
+        spinlock_unlock(&victim->cpu_lock);
+        if (p) {
+            if (p->p_pass < c->cpu_pass) {
+                p->p_pass = c->cpu_pass;
+            }
+            runq_take(c, p);
+            __atomic_add_fetch(&c->cpu_nstolen, 1, __ATOMIC_RELAXED);
+            return p;
+        }
+    }
+    return NULL;
+}
+
+
+// sched_admit(p, stride)
+//    Queue newly runnable process `p` on this CPU, starting it at the
+//    current pass so it neither waits behind nor monopolizes processes
+//    already running.
+
+static void sched_admit(proc* p, uint64_t stride) {
+    cpustate* c = this_cpu();
+    p->p_stride = stride;
+    p->p_nruns = 0;
+    spinlock_lock(&c->cpu_lock);
+    p->p_pass = c->cpu_pass;
+    runq_push(c, p);
+    spinlock_unlock(&c->cpu_lock);
+}
+
+
+// sleepq_insert(p)
+//    Queue sleeping process `p` in wakeup order, after processes due at
+//    the same tick. The caller must hold `proc_lock`.
+
+static void sleepq_insert(proc* p) {
+    proc** pp = &sleepq_head;
+    while (*pp && (int) ((*pp)->p_wakeup - p->p_wakeup) <= 0) {
+        pp = &(*pp)->p_runq_next;
+    }
+    p->p_runq_next = *pp;
+    p->p_runq_prev = NULL;
+    *pp = p;
+}
+
+
+// timer_tick
+//    Count a timer interrupt and wake the processes whose sleep is over.
+//    With TICK_LIMIT, also dump memory state once a second and power off
+//    at the limit, whether or not any process is running. Runs on CPU 0.
+
+static void timer_tick(void) {
+#if TICK_LIMIT
+    if (ticks == TICK_LIMIT) {
+        poweroff();
+    }
+    if (ticks % HZ == 0) {
+        spinlock_lock(&proc_lock);
+        spinlock_lock(&page_lock);
+        memdump_physical();
+        memdump_virtual_all();
+        spinlock_unlock(&page_lock);
+        spinlock_unlock(&proc_lock);
+    }
+#endif
+    spinlock_lock(&proc_lock);
+    ++ticks;
+    while (sleepq_head && (int) (sleepq_head->p_wakeup - ticks) <= 0) {
+        proc* p = sleepq_head;
+        sleepq_head = p->p_runq_next;
+        sched_wake(p);
+    }
+    spinlock_unlock(&proc_lock);
+}
+
+
+// sched_wake(p)
+//    Make blocked process `p`, already unlinked from its wait queue,
+//    runnable again on this CPU. The caller must hold `proc_lock`.
+
+static void sched_wake(proc* p) {
+    cpustate* c = this_cpu();
+    p->p_state = P_RUNNABLE;
+    spinlock_lock(&c->cpu_lock);
+    if (p->p_pass < c->cpu_pass) {
+        p->p_pass = c->cpu_pass;        // no stride credit for blocking
+    }
+    runq_push(c, p);
+    spinlock_unlock(&c->cpu_lock);
+}
+
+
+// profile_sample(reg)
+//    Count a timer sample at the interrupted state `reg`.
+
+static void profile_sample(x86_64_registers* reg) {
+#if PROFILE
+    int user = (reg->reg_cs & 3) != 0;
+    pid_t pid = user ? current->p_pid : 0;
+    int program = user ? current->p_program : -1;
+    unsigned slot = (reg->reg_rip * 0x9E3779B97F4A7C15UL + pid) >> 54;
+    spinlock_lock(&profile_lock);
+    for (int i = 0; i < PROFILE_SLOTS; ++i) {
+        profile_entry* e = &profile_table[(slot + i) % PROFILE_SLOTS];
+        if (e->count == 0) {
+            e->rip = reg->reg_rip;
+            e->pid = pid;
+            e->program = program;
+        }
+        if (e->rip == reg->reg_rip && e->pid == pid
+            && e->program == program) {
+            ++e->count;
+            ++profile_nsamples;
+            spinlock_unlock(&profile_lock);
+            return;
+        }
+    }
+    ++profile_dropped;
+    spinlock_unlock(&profile_lock);
+#else
+    (void) reg;
+#endif
+}
+
+
+// profile_dump
+//    Log every profile table entry and a summary line.
+
+void profile_dump(void) {
+#if PROFILE
+    spinlock_lock(&profile_lock);
+    for (int i = 0; i < PROFILE_SLOTS; ++i) {
+        profile_entry* e = &profile_table[i];
+        if (e->count) {
+            log_printf("PROFILE %c %d %d %p %u\n", e->program < 0 ? 'K' : 'U',
+                       e->pid, e->program, e->rip, e->count);
+        }
+    }
+    log_printf("PROFILE_SUMMARY %u samples, %u dropped\n",
+               profile_nsamples, profile_dropped);
+    spinlock_unlock(&profile_lock);
+#endif
+}
+
+
+// stats_for(intno)
+//    Return the statistics kept for interrupt number `intno`, or NULL.
+
+static exception_stats* stats_for(int intno) {
+    if (intno >= INT_SYS && intno < INT_SYS + 16) {
+        return &int_stats[intno - INT_SYS];
+    } else if (intno == INT_TIMER) {
+        return &int_stats[16];
+    } else if (intno == INT_PAGEFAULT) {
+        return &int_stats[17];
+    } else {
+        return NULL;
+    }
+}
+
+
+// stats_record(st, cycles)
+//    Count one exception that took `cycles` in `*st`. The caller must
+//    hold `stats_lock`.
+
+static void stats_record(exception_stats* st, uint64_t cycles) {
+    if (st->count == 0 || cycles < st->min_cycles) {
+        st->min_cycles = cycles;
+    }
+    if (cycles > st->max_cycles) {
+        st->max_cycles = cycles;
+    }
+    ++st->count;
+    st->cycles += cycles;
+    ++st->hist[stats_bucket(cycles)];
+}
+
+
+// sched_log
+//    Log scheduling overhead, and how many turns each process ran and how
+//    many pages it owns (the allocators' progress), since the last call.
+//    Also log, for the whole machine, the pages allocated and processes
+//    exited in that time, and the turns each CPU ran and stole, which is
+//    what to compare between runs with different numbers of CPUs.
+
+static void sched_log(void) {
+    static unsigned last_npages, last_exits;
+    uint64_t cycles = __atomic_exchange_n(&sched_cycles, 0, __ATOMIC_RELAXED);
+    unsigned count = __atomic_exchange_n(&sched_count, 0, __ATOMIC_RELAXED);
+    if (count) {
+        log_printf("sched: %u picks, %lu cycles/pick\n",
+                   count, cycles / count);
+    }
+
+    int npages[NPROC] = { 0 };
+    unsigned nruns[NPROC] = { 0 };
+    spinlock_lock(&proc_lock);
+    spinlock_lock(&page_lock);
+    for (int pn = 0; pn < NPAGES; ++pn) {
+        if (pageinfo[pn].owner > 0) {
+            ++npages[pageinfo[pn].owner];
+        }
+    }
+    for (pid_t pid = 1; pid < NPROC; ++pid) {
+        if (processes[pid].p_state == P_FREE) {
+            npages[pid] = -1;
+        } else {
+            nruns[pid] = __atomic_exchange_n(&processes[pid].p_nruns, 0,
+                                             __ATOMIC_RELAXED);
+        }
+    }
+    unsigned exits = sched_exits;
+    spinlock_unlock(&page_lock);
+    spinlock_unlock(&proc_lock);
+
+    for (pid_t pid = 1; pid < NPROC; ++pid) {
+        if (npages[pid] >= 0) {
+            log_printf("sched: pid %d ran %u turns, owns %d pages\n",
+                       pid, nruns[pid], npages[pid]);
+        }
+    }
+
+    char buf[40 * NCPU];
+    size_t len = 0;
+    for (int i = 0; i < ncpu; ++i) {
+        unsigned n = __atomic_exchange_n(&cpus[i].cpu_nruns, 0,
+                                         __ATOMIC_RELAXED);
+        unsigned s = __atomic_exchange_n(&cpus[i].cpu_nstolen, 0,
+                                         __ATOMIC_RELAXED);
+        len += snprintf(buf + len, sizeof(buf) - len,
+                        ", cpu%d %u turns (%u stolen)", i, n, s);
+    }
+    unsigned allocated = __atomic_load_n(&alloc_npages, __ATOMIC_RELAXED);
+    log_printf("smp: %d CPUs, %u pages allocated, %u exits%s\n", ncpu,
+               allocated - last_npages, exits - last_exits, buf);
+    last_npages = allocated;
+    last_exits = exits;
+}
+
+
 // schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Pick the next process to run and then run it. A runnable `current`
+//    goes to the back of this CPU's run queue first, so yielding or being
+//    preempted lets every other runnable process here go before it. If
+//    this CPU's queue is empty, steals from another CPU's. If there are
+//    no runnable processes at all, halts until an interrupt (a timer tick
+//    may wake a sleeper) and tries again.
 
 void schedule(void) {
-    pid_t pid = current->p_pid;
+    uint64_t t0 = read_cycle_counter();
+    cpustate* c = this_cpu();
+    proc* prev = c->cpu_current;
+    c->cpu_current = NULL;
+
+    spinlock_lock(&c->cpu_lock);
+    if (prev && prev->p_state == P_RUNNABLE) {
+        runq_push(c, prev);
+    }
     while (1) {
-        pid = (pid + 1) % NPROC;
-        if (processes[pid].p_state == P_RUNNABLE) {
-            run(&processes[pid]);
+        proc* p = runq_pick(c);
+        spinlock_unlock(&c->cpu_lock);
+        if (!p) {
+            p = runq_steal(c);
+        }
+        if (p) {
+            __atomic_add_fetch(&sched_cycles, read_cycle_counter() - t0,
+                               __ATOMIC_RELAXED);
+            __atomic_add_fetch(&sched_count, 1, __ATOMIC_RELAXED);
+            run(p);
         }
         // If Control-C was typed, exit the virtual machine.
         check_keyboard();
+        // `sti` takes effect after `hlt` starts, so no interrupt is missed.
+        asm volatile("sti; hlt; cli" : : : "memory");
+        spinlock_lock(&c->cpu_lock);
     }
 }
 
@@ -463,12 +1958,22 @@ void schedule(void) {
 // run(p)
 //    Run process `p`. This means reloading all the registers from
 //    `p->p_registers` using the `popal`, `popl`, and `iret` instructions.
+//    `p` must be runnable and on no run queue.
 //
 //    As a side effect, sets `current = p`.
 
 void run(proc* p) {
+    cpustate* c = this_cpu();
     assert(p->p_state == P_RUNNABLE);
-    current = p;
+    c->cpu_current = p;
+
+    if (c->cpu_trap_stats) {
+        spinlock_lock(&stats_lock);
+        stats_record(c->cpu_trap_stats,
+                     read_cycle_counter() - c->cpu_trap_start);
+        spinlock_unlock(&stats_lock);
+        c->cpu_trap_stats = NULL;
+    }
 
     // Load the process's current pagetable.
     set_pagetable(p->p_pagetable);
@@ -486,19 +1991,30 @@ void run(proc* p) {
 
 void pageinfo_init(void) {
     extern char end[];
+    assert((uintptr_t) end <= KERNEL_STACK_TOP - NCPU * PAGESIZE);
+
+    memset(page_free_bits, 0, sizeof(page_free_bits));
+    page_free_words = 0;
+    page_nfree = 0;
+    memset(pm_dirty, 0xFF, sizeof(pm_dirty));
+    memset(vm_pm_dirty, 0xFF, sizeof(vm_pm_dirty));
 
     for (uintptr_t addr = 0; addr < MEMSIZE_PHYSICAL; addr += PAGESIZE) {
         int owner;
         if (physical_memory_isreserved(addr)) {
             owner = PO_RESERVED;
         } else if ((addr >= KERNEL_START_ADDR && addr < (uintptr_t) end)
-                   || addr == KERNEL_STACK_TOP - PAGESIZE) {
+                   || (addr >= KERNEL_STACK_TOP - NCPU * PAGESIZE
+                       && addr < KERNEL_STACK_TOP)) {
             owner = PO_KERNEL;
         } else {
             owner = PO_FREE;
         }
         pageinfo[PAGENUMBER(addr)].owner = owner;
         pageinfo[PAGENUMBER(addr)].refcount = (owner != PO_FREE);
+        if (owner == PO_FREE) {
+            page_mark_free(PAGENUMBER(addr));
+        }
     }
 }
 
@@ -524,11 +2040,13 @@ void check_page_table_mappings(x86_64_pagetable* pt) {
         }
     }
 
-    // kernel stack is identity mapped and writable
-    uintptr_t kstack = KERNEL_STACK_TOP - PAGESIZE;
-    vamapping vam = virtual_memory_lookup(pt, kstack);
-    assert(vam.pa == kstack);
-    assert(vam.perm & PTE_W);
+    // every CPU's kernel stack is identity mapped and writable
+    for (int i = 1; i <= NCPU; ++i) {
+        uintptr_t kstack = KERNEL_STACK_TOP - i * PAGESIZE;
+        vamapping vam = virtual_memory_lookup(pt, kstack);
+        assert(vam.pa == kstack);
+        assert(vam.perm & PTE_W);
+    }
 }
 
 
@@ -619,24 +2137,75 @@ static const uint16_t memstate_colors[] = {
 };
 
 void memshow_physical(void) {
-    console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
-    for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); ++pn) {
-        if (pn % 64 == 0) {
+    static unsigned last_full = 0;
+    uint64_t start = read_cycle_counter();
+
+    // repaint everything every 0.5 sec, in case console output
+    // overwrote the display
+    int full = last_full == 0 || ticks - last_full >= HZ / 2;
+    if (full) {
+        last_full = ticks;
+        console_printf(CPOS(0, 32), 0x0F00, "PHYSICAL MEMORY");
+        for (int pn = 0; pn < PAGENUMBER(MEMSIZE_PHYSICAL); pn += 64) {
             console_printf(CPOS(1 + pn / 64, 3), 0x0F00, "0x%06X ", pn << 12);
         }
+        memset(pm_dirty, 0xFF, sizeof(pm_dirty));
+    }
 
-        int owner = pageinfo[pn].owner;
-        if (pageinfo[pn].refcount == 0) {
+    for (int w = 0; w < PAGE_BITMAP_WORDS; ++w) {
+        while (pm_dirty[w]) {
+            int pn = w * 64 + __builtin_ctzl(pm_dirty[w]);
+            pm_dirty[w] &= pm_dirty[w] - 1;
+
+            int owner = pageinfo[pn].owner;
+            if (pageinfo[pn].refcount == 0) {
+                owner = PO_FREE;
+            }
+            uint16_t color = memstate_colors[owner - PO_KERNEL];
+            // darker color for shared pages
+            if (pageinfo[pn].refcount > 1) {
+                color &= 0x77FF;
+            }
+
+            console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
+        }
+    }
+
+    memshow_cycles[full] += read_cycle_counter() - start;
+    ++memshow_count[full];
+}
+
+
+// memshow_virtual_cell(va, vam)
+//    Draw the cell for virtual address `va`, mapped as `vam`, in the
+//    virtual memory map picture.
+
+static int memshow_vpn[MEMSIZE_VIRTUAL / PAGESIZE]; // page shown per cell
+
+static void memshow_virtual_cell(uintptr_t va, vamapping vam) {
+    uint16_t color;
+    if (vam.pn < 0) {
+        color = ' ';
+    } else {
+        assert(vam.pa < MEMSIZE_PHYSICAL);
+        int owner = pageinfo[vam.pn].owner;
+        if (pageinfo[vam.pn].refcount == 0) {
             owner = PO_FREE;
         }
-        uint16_t color = memstate_colors[owner - PO_KERNEL];
+        color = memstate_colors[owner - PO_KERNEL];
+        // reverse video for user-accessible pages
+        if (vam.perm & PTE_U) {
+            color = ((color & 0x0F00) << 4) | ((color & 0xF000) >> 4)
+                | (color & 0x00FF);
+        }
         // darker color for shared pages
-        if (pageinfo[pn].refcount > 1) {
+        if (pageinfo[vam.pn].refcount > 1) {
             color &= 0x77FF;
         }
-
-        console[CPOS(1 + pn / 64, 12 + pn % 64)] = color;
     }
+    uint32_t pn = PAGENUMBER(va);
+    memshow_vpn[pn] = vam.pn;
+    console[CPOS(11 + pn / 64, 12 + pn % 64)] = color;
 }
 
 
@@ -648,33 +2217,50 @@ void memshow_virtual(x86_64_pagetable* pagetable, const char* name) {
     assert((uintptr_t) pagetable == PTE_ADDR(pagetable));
 
     console_printf(CPOS(10, 26), 0x0F00, "VIRTUAL ADDRESS SPACE FOR %s", name);
+    vmiter it;
+    virtual_memory_iter_init(&it, pagetable, 0, MEMSIZE_VIRTUAL);
+    int mapped = virtual_memory_iter_next(&it);
     for (uintptr_t va = 0; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
-        vamapping vam = virtual_memory_lookup(pagetable, va);
-        uint16_t color;
-        if (vam.pn < 0) {
-            color = ' ';
-        } else {
-            assert(vam.pa < MEMSIZE_PHYSICAL);
-            int owner = pageinfo[vam.pn].owner;
-            if (pageinfo[vam.pn].refcount == 0) {
-                owner = PO_FREE;
-            }
-            color = memstate_colors[owner - PO_KERNEL];
-            // reverse video for user-accessible pages
-            if (vam.perm & PTE_U) {
-                color = ((color & 0x0F00) << 4) | ((color & 0xF000) >> 4)
-                    | (color & 0x00FF);
-            }
-            // darker color for shared pages
-            if (pageinfo[vam.pn].refcount > 1) {
-                color &= 0x77FF;
-            }
+        vamapping vam = { -1, (uintptr_t) -1, 0 };
+        if (mapped && it.va == va) {
+            vam = it.map;
+            mapped = virtual_memory_iter_next(&it);
         }
         uint32_t pn = PAGENUMBER(va);
         if (pn % 64 == 0) {
             console_printf(CPOS(11 + pn / 64, 3), 0x0F00, "0x%06X ", va);
         }
-        console[CPOS(11 + pn / 64, 12 + pn % 64)] = color;
+        memshow_virtual_cell(va, vam);
+    }
+}
+
+
+// memshow_virtual_update(pid)
+//    Repaint the cells of the virtual memory map picture of process `pid`,
+//    which is on screen, whose mapping or physical page changed.
+
+static void memshow_virtual_update(pid_t pid) {
+    uint64_t pm_changed = 0;
+    for (int w = 0; w < PAGE_BITMAP_WORDS; ++w) {
+        pm_changed |= vm_pm_dirty[w];
+    }
+    if (pm_changed) {
+        for (int i = 0; i < MEMSIZE_VIRTUAL / PAGESIZE; ++i) {
+            int pn = memshow_vpn[i];
+            if (pn >= 0 && (vm_pm_dirty[pn / 64] & (1UL << (pn % 64)))) {
+                vm_dirty[pid][i / 64] |= 1UL << (i % 64);
+            }
+        }
+    }
+
+    for (int w = 0; w < VM_DIRTY_WORDS; ++w) {
+        while (vm_dirty[pid][w]) {
+            int i = w * 64 + __builtin_ctzl(vm_dirty[pid][w]);
+            vm_dirty[pid][w] &= vm_dirty[pid][w] - 1;
+            uintptr_t va = PAGEADDRESS(i);
+            memshow_virtual_cell(va, virtual_memory_lookup(
+                                         processes[pid].p_pagetable, va));
+        }
     }
 }
 
@@ -682,15 +2268,19 @@ void memshow_virtual(x86_64_pagetable* pagetable, const char* name) {
 // memshow_virtual_animate
 //    Draw a picture of process virtual memory maps on the CGA console.
 //    Starts with process 1, then switches to a new process every 0.25 sec.
+//    Between switches, only changed cells are repainted.
 
 void memshow_virtual_animate(void) {
     static unsigned last_ticks = 0;
     static int showing = 1;
+    static int shown = -1;      // process whose map is on screen
+    int full = 0;
 
     // switch to a new process every 0.25 sec
     if (last_ticks == 0 || ticks - last_ticks >= HZ / 2) {
         last_ticks = ticks;
         ++showing;
+        full = 1;
     }
 
     // the current process may have died -- don't display it if so
@@ -701,10 +2291,21 @@ void memshow_virtual_animate(void) {
     showing = showing % NPROC;
 
     if (processes[showing].p_state != P_FREE) {
-        char s[4];
-        snprintf(s, 4, "%d ", showing);
-        memshow_virtual(processes[showing].p_pagetable, s);
+        uint64_t start = read_cycle_counter();
+        full = full || showing != shown;
+        if (full) {
+            char s[4];
+            snprintf(s, 4, "%d ", showing);
+            memshow_virtual(processes[showing].p_pagetable, s);
+            memset(vm_dirty[showing], 0, sizeof(vm_dirty[showing]));
+            shown = showing;
+        } else {
+            memshow_virtual_update(showing);
+        }
+        memshow_cycles[full] += read_cycle_counter() - start;
+        ++memshow_count[full];
     }
+    memset(vm_pm_dirty, 0, sizeof(vm_pm_dirty));
 }
 
 
@@ -725,15 +2326,19 @@ void memdump_physical(void) {
 void memdump_virtual(x86_64_pagetable* pagetable, const char* name) {
   log_printf("VM_DUMP %s %u ", name, ticks);
   assert((uintptr_t)pagetable == PTE_ADDR(pagetable));
+  vmiter it;
+  virtual_memory_iter_init(&it, pagetable, 0, MEMSIZE_VIRTUAL);
+  int mapped = virtual_memory_iter_next(&it);
   for (uintptr_t va = 0; va < MEMSIZE_VIRTUAL; va += PAGESIZE) {
-    vamapping vam = virtual_memory_lookup(pagetable, va);
-    if (vam.pn < 0) {
+    if (!mapped || it.va != va) {
       log_printf("0 0 0 ");
       continue;
     }
+    vamapping vam = it.map;
+    mapped = virtual_memory_iter_next(&it);
 
     uint8_t owner = pageinfo[vam.pn].owner;
-    uint8_t refcount = pageinfo[vam.pn].refcount;
+    uint16_t refcount = pageinfo[vam.pn].refcount;
     log_printf("%u %u %u ", owner, refcount, vam.perm);
   }
   log_printf("\n");
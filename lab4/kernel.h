@@ -24,14 +24,58 @@ typedef struct proc {
     x86_64_registers p_registers;       // process's current registers
     procstate_t p_state;                // process state (see above)
     x86_64_pagetable* p_pagetable;      // process's page table
+    struct proc* p_runq_next;           // run queue links (see schedule())
+    struct proc* p_runq_prev;
+    uint64_t p_pass;                    // stride scheduling: virtual time
+    uint64_t p_stride;                  //   advanced per turn run
+    unsigned p_nruns;                   // turns run since last sched log
+    unsigned p_wakeup;                  // P_BLOCKED in sys_sleep: wake at
+                                        //   this `ticks` value
+    int p_program;                      // program number (see k-loader.c)
+    uintptr_t p_futex;                  // P_BLOCKED in sys_futex_wait:
+                                        //   physical address of the word
 } proc;
 
 #define NPROC 16                // maximum number of processes
+#define NCPU 4                  // maximum number of CPUs used
+
+
+// Spinlocks
+
+typedef struct spinlock {
+    volatile int locked;
+} spinlock;
+
+static inline void spinlock_init(spinlock* lock) {
+    lock->locked = 0;
+}
+
+static inline void spinlock_lock(spinlock* lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+static inline void spinlock_unlock(spinlock* lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+// Page table entry flag for copy-on-write pages (one of the PTE_AVAIL
+// bits). A PTE_COW page is mapped read-only and shared; the first write
+// fault gives the writer its own copy.
+#define PTE_COW ((x86_64_pageentry_t) 0x200)
+
+// Page table entry flag for shared memory region pages (another PTE_AVAIL
+// bit). Fork shares PTE_SHARED pages writable instead of copy-on-write.
+#define PTE_SHARED ((x86_64_pageentry_t) 0x400)
 
 
 // Kernel start address
 #define KERNEL_START_ADDR       0x40000
-// Top of the kernel stack
+// Top of the kernel stacks: CPU `i`'s kernel stack is the page below
+// KERNEL_STACK_TOP - i * PAGESIZE
 #define KERNEL_STACK_TOP        0x80000
 
 // First application-accessible address
@@ -50,6 +94,14 @@ typedef struct proc {
 #define INT_TIMER               (INT_HARDWARE + 0)
 
 
+// cpu_index()
+//    Return the index of the CPU running this code, from the kernel stack
+//    it runs on.
+static inline int cpu_index(void) {
+    return (KERNEL_STACK_TOP - 1 - read_rsp()) / PAGESIZE;
+}
+
+
 // hardware_init
 //    Initialize x86 hardware, including memory, interrupts, and segments.
 //    All accessible physical memory is initially mapped as readable
@@ -61,6 +113,30 @@ void hardware_init(void);
 //    timer interrupt if `rate <= 0`.
 void timer_init(int rate);
 
+// cpus_start()
+//    Start the application processors (up to NCPU CPUs in all) with INIT
+//    and STARTUP IPIs. Each gets its own kernel stack and task state, takes
+//    INT_TIMER from its local APIC timer at the rate timer_init() set, and
+//    calls schedule(). Returns the number of CPUs running, the boot CPU
+//    included. Must run on the boot CPU, after timer_init() enabled the
+//    timer, with `kernel_pagetable` loaded.
+int cpus_start(void);
+
+// cpus_stop()
+//    Return the application processors to the state they were in at boot,
+//    waiting for a STARTUP IPI. Must run with `kernel_pagetable` loaded.
+void cpus_stop(void);
+
+// lapic_eoi()
+//    Acknowledge the local APIC interrupt being handled (the timer
+//    interrupt of an application processor). Must run with
+//    `kernel_pagetable` loaded.
+void lapic_eoi(void);
+
+// schedule()
+//    Run a runnable process on this CPU; defined in kernel.c.
+void schedule(void);
+
 
 // kernel page table (used for virtual memory)
 extern x86_64_pagetable* kernel_pagetable;
@@ -87,6 +163,16 @@ int virtual_memory_map(x86_64_pagetable* pagetable, uintptr_t va,
                        uintptr_t pa, size_t sz, int perm,
                        x86_64_pagetable* (*allocator)(void));
 
+// virtual_memory_map_pages(pagetable, va, pas, npages, perm, allocator)
+//    Map the `npages` pages starting at virtual address `va` to physical
+//    pages `pas[0]`, `pas[1]`, ..., with permissions `perm` (which must
+//    include PTE_P), walking to each last-level page table only once.
+//    Returns the number of pages mapped, which is less than `npages` only
+//    if a required page table could not be allocated.
+size_t virtual_memory_map_pages(x86_64_pagetable* pagetable, uintptr_t va,
+                                const uintptr_t* pas, size_t npages, int perm,
+                                x86_64_pagetable* (*allocator)(void));
+
 // virtual_memory_lookup(pagetable, va)
 //    Returns information about the mapping of the virtual address `va` in
 //    `pagetable`. The information is returned as a `vamapping` object,
@@ -94,17 +180,63 @@ int virtual_memory_map(x86_64_pagetable* pagetable, uintptr_t va,
 typedef struct vamapping {
     int pn;           // physical page number; -1 if unmapped
     uintptr_t pa;     // physical address; (uintptr_t) -1 if unmapped
-    int perm;         // permissions; 0 if unmapped
+    int perm;         // permissions, plus the last-level entry's
+                      // PTE_AVAIL bits (e.g. PTE_COW); 0 if unmapped
 } vamapping;
 
 vamapping virtual_memory_lookup(x86_64_pagetable* pagetable, uintptr_t va);
 
+// virtual_memory_iter_init(it, pagetable, va, end)
+// virtual_memory_iter_next(it)
+//    Iterate over the present last-level mappings in `pagetable` for
+//    virtual addresses `[va, end)`, in address order:
+//
+//        vmiter it;
+//        virtual_memory_iter_init(&it, pagetable, va, end);
+//        while (virtual_memory_iter_next(&it)) {
+//            ... it.va is mapped as described by it.map ...
+//        }
+//
+//    it.map is what virtual_memory_lookup(pagetable, it.va) would return.
+//    Absent upper-level entries are skipped whole, and consecutive
+//    mappings in one last-level page table cost no extra walk. The
+//    iterator reads entries as it goes, so the caller may change the
+//    mapping at it.va.
+typedef struct vmiter {
+    x86_64_pagetable* pagetable;
+    uintptr_t va;                   // address of current mapping
+    vamapping map;                  // current mapping
+    uintptr_t next;                 // where the search resumes
+    uintptr_t end;
+    x86_64_pagetable* l4pagetable;  // last-level table for `next`, or NULL
+    int l4perms;                    // permissions granted above it
+} vmiter;
+
+void virtual_memory_iter_init(vmiter* it, x86_64_pagetable* pagetable,
+                              uintptr_t va, uintptr_t end);
+int virtual_memory_iter_next(vmiter* it);
+
 // assign_physical_page(addr, owner)
 //    Assigns the page with physical address `addr` to the given owner.
 //    Fails if physical page `addr` was already allocated. Returns 0 on
 //    success and -1 on failure. Used by the program loader.
 int assign_physical_page(uintptr_t addr, int8_t owner);
 
+// page_alloc(owner)
+//    Allocates a free physical page to `owner` with reference count 1.
+//    Returns its physical address, or 0 if physical memory is exhausted.
+//    The page is not cleared.
+uintptr_t page_alloc(int8_t owner);
+
+// page_free(addr)
+//    Drops one reference to the physical page at `addr`; the page is free
+//    again once its reference count reaches 0.
+void page_free(uintptr_t addr);
+
+// page_ref(addr)
+//    Adds a reference to the allocated physical page at `addr`.
+void page_ref(uintptr_t addr);
+
 // physical_memory_isreserved(pa)
 //    Returns non-zero iff `pa` is a reserved physical address.
 int physical_memory_isreserved(uintptr_t pa);
@@ -124,6 +256,11 @@ void check_page_table_mappings(x86_64_pagetable* pagetable);
 //    Turn off the virtual machine.
 void poweroff(void) __attribute__((noreturn));
 
+// profile_dump
+//    Log the timer-sampled profile (PROFILE builds only). Called on
+//    poweroff; symbolize the log with `profile_report.py`.
+void profile_dump(void);
+
 // reboot
 //    Reboot the virtual machine.
 void reboot(void) __attribute__((noreturn));
@@ -160,9 +297,12 @@ int keyboard_readc(void);
 #define KEY_DELETE      0311
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
+//    Check for the user typing a control key. 'a', 'f', 'e', 'b', 's',
+//    'y', 'm', 'l', 'p', and 't' cause a soft reboot where the kernel runs
+//    the allocator programs, "fork", "forkexit", "pagebench", "forkstress",
+//    "syscallbench", "membench", "latency", "pingpong", or "sametext",
+//    respectively.
+//    Control-C or 'q' exit the virtual machine.
 //    Returns key typed or -1 for no key.
 int check_keyboard(void);
 
@@ -185,6 +325,15 @@ void process_init(proc* p, int flags);
 int program_load(proc* p, int programnumber,
                  x86_64_pagetable* (*allocator)(void));
 
+// text_cache_init()
+//    Forget every cached program text page. Called at (soft) boot.
+void text_cache_init(void);
+
+// text_cache_evict(addr)
+//    Called when physical page `addr` is freed; drops it from the program
+//    text cache if it is cached there.
+void text_cache_evict(uintptr_t addr);
+
 
 // log_printf, log_vprintf
 //    Print debugging messages to the host's `log.txt` file. We run QEMU
@@ -8,11 +8,37 @@
 
 // memcpy, memmove, memset, strcmp, strlen, strnlen
 //    We must provide our own implementations.
+//
+//    The memory functions move 8-byte words once the destination is
+//    aligned (for copies, only if the source is then aligned too), and
+//    hand blocks of at least MEM_REP_MIN bytes to `rep movsq`/`rep stosq`.
+//    Leftover bytes at either end go one at a time.
+
+#define MEM_REP_MIN 256
+
+typedef uint64_t __attribute__((may_alias)) memword_t;
 
 void* memcpy(void* dst, const void* src, size_t n) {
     const char* s = (const char*) src;
-    for (char* d = (char*) dst; n > 0; --n, ++s, ++d) {
-        *d = *s;
+    char* d = (char*) dst;
+    if (n >= 2 * sizeof(memword_t)
+        && ((uintptr_t) d & 7) == ((uintptr_t) s & 7)) {
+        for (; (uintptr_t) d & 7; --n) {
+            *d++ = *s++;
+        }
+        size_t nw = n / sizeof(memword_t);
+        n %= sizeof(memword_t);
+        if (nw * sizeof(memword_t) >= MEM_REP_MIN) {
+            asm volatile("rep movsq"
+                         : "+D" (d), "+S" (s), "+c" (nw) : : "memory");
+        } else {
+            for (; nw > 0; --nw, d += 8, s += 8) {
+                *(memword_t*) d = *(const memword_t*) s;
+            }
+        }
+    }
+    for (; n > 0; --n) {
+        *d++ = *s++;
     }
     return dst;
 }
@@ -20,26 +46,68 @@ void* memcpy(void* dst, const void* src, size_t n) {
 void* memmove(void* dst, const void* src, size_t n) {
     const char* s = (const char*) src;
     char* d = (char*) dst;
-    if (s < d && s + n > d) {
-        s += n, d += n;
-        while (n-- > 0) {
+    if (!(s < d && s + n > d)) {
+        // a forward copy never overwrites source bytes it has yet to read
+        return memcpy(dst, src, n);
+    }
+
+    s += n, d += n;
+    if (n >= 2 * sizeof(memword_t)
+        && ((uintptr_t) d & 7) == ((uintptr_t) s & 7)) {
+        for (; (uintptr_t) d & 7; --n) {
             *--d = *--s;
         }
-    } else {
-        while (n-- > 0) {
-            *d++ = *s++;
+        for (; n >= sizeof(memword_t); n -= sizeof(memword_t)) {
+            d -= 8, s -= 8;
+            *(memword_t*) d = *(const memword_t*) s;
         }
     }
+    while (n-- > 0) {
+        *--d = *--s;
+    }
     return dst;
 }
 
 void* memset(void* v, int c, size_t n) {
-    for (char* p = (char*) v; n > 0; ++p, --n) {
-        *p = c;
+    char* p = (char*) v;
+    if (n >= 2 * sizeof(memword_t)) {
+        uint64_t word = (uint8_t) c * 0x0101010101010101UL;
+        for (; (uintptr_t) p & 7; --n) {
+            *p++ = c;
+        }
+        size_t nw = n / sizeof(memword_t);
+        n %= sizeof(memword_t);
+        if (nw * sizeof(memword_t) >= MEM_REP_MIN) {
+            asm volatile("rep stosq"
+                         : "+D" (p), "+c" (nw) : "a" (word) : "memory");
+        } else {
+            for (; nw > 0; --nw, p += 8) {
+                *(memword_t*) p = word;
+            }
+        }
+    }
+    for (; n > 0; --n) {
+        *p++ = c;
     }
     return v;
 }
 
+
+// page_zero, page_copy
+//    Page-sized `rep stosq`/`rep movsq`. Addresses must be page-aligned.
+
+void page_zero(void* page) {
+    size_t nw = PAGESIZE / sizeof(uint64_t);
+    asm volatile("rep stosq"
+                 : "+D" (page), "+c" (nw) : "a" (0UL) : "memory");
+}
+
+void page_copy(void* dst, const void* src) {
+    size_t nw = PAGESIZE / sizeof(uint64_t);
+    asm volatile("rep movsq"
+                 : "+D" (dst), "+S" (src), "+c" (nw) : : "memory");
+}
+
 size_t strlen(const char* s) {
     size_t n;
     for (n = 0; *s != '\0'; ++s) {
@@ -39,6 +39,8 @@ typedef int pid_t;                    // process IDs
 void* memcpy(void* dst, const void* src, size_t n);
 void* memmove(void* dst, const void* src, size_t n);
 void* memset(void* s, int c, size_t n);
+void page_zero(void* page);
+void page_copy(void* dst, const void* src);
 size_t strlen(const char* s);
 size_t strnlen(const char* s, size_t maxlen);
 char* strcpy(char* dst, const char* src);
@@ -100,6 +102,51 @@ void panic(const char* format, ...) __attribute__((noinline, noreturn));
 #define INT_SYS_PAGE_ALLOC      (INT_SYS + 3)
 #define INT_SYS_FORK            (INT_SYS + 4)
 #define INT_SYS_EXIT            (INT_SYS + 5)
+#define INT_SYS_SLEEP           (INT_SYS + 6)
+#define INT_SYS_GETSTATS        (INT_SYS + 7)
+#define INT_SYS_PAGE_ALLOC_RANGE (INT_SYS + 8)
+#define INT_SYS_SHM_CREATE      (INT_SYS + 9)
+#define INT_SYS_SHM_MAP         (INT_SYS + 10)
+#define INT_SYS_FUTEX_WAIT      (INT_SYS + 11)
+#define INT_SYS_FUTEX_WAKE      (INT_SYS + 12)
+
+// sys_page_alloc_range flags
+#define PAGE_ALLOC_ALL          0x1     // map all the pages or none
+
+
+// Exception statistics, kept by the kernel per interrupt number and read
+// with sys_getstats. Latencies run from kernel entry to the return to
+// user mode. The histogram splits each power of 2 cycles into 4 buckets.
+
+#define STATS_NBUCKETS 128
+
+typedef struct exception_stats {
+    uint64_t count;                     // exceptions handled
+    uint64_t cycles;                    // total latency
+    uint64_t min_cycles;
+    uint64_t max_cycles;
+    uint32_t hist[STATS_NBUCKETS];      // counts by stats_bucket(latency)
+} exception_stats;
+
+// stats_bucket(cycles)
+//    Return the histogram bucket for a latency of `cycles`.
+static inline int stats_bucket(uint64_t cycles) {
+    if (cycles < 4) {
+        return cycles;
+    }
+    int msb = 63 - __builtin_clzl(cycles);
+    int b = 4 * (msb - 1) + ((cycles >> (msb - 2)) & 3);
+    return b < STATS_NBUCKETS ? b : STATS_NBUCKETS - 1;
+}
+
+// stats_bucket_min(b)
+//    Return the smallest latency that falls in bucket `b`.
+static inline uint64_t stats_bucket_min(int b) {
+    if (b < 4) {
+        return b;
+    }
+    return (uint64_t) (4 + b % 4) << (b / 4 - 1);
+}
 
 
 // Console printing
@@ -115,6 +162,10 @@ extern uint16_t console[CONSOLE_ROWS * CONSOLE_COLUMNS];
 // current position of the cursor (80 * ROW + COL)
 extern int cursorpos;
 
+// number of timer interrupts so far; like `cursorpos`, it lives past the
+// end of the console in the console page, so processes can read it
+extern volatile unsigned ticks;
+
 // console_clear
 //    Erases the console and moves the cursor to the upper left (CPOS(0, 0)).
 void console_clear(void);
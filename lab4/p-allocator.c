@@ -40,6 +40,6 @@ void process_main(void) {
 
     // After running out of memory, do nothing forever
     while (1) {
-        sys_yield();
+        sys_sleep(100);
     }
 }
@@ -0,0 +1,51 @@
+#include "process.h"
+#include "lib.h"
+
+// p-forkstress.c
+//
+//    Forks and exits FORKSTRESS_ROUNDS times. Each child writes its data
+//    page (forcing a copy-on-write copy), allocates and touches a heap
+//    page, and exits, so a kernel that leaks pages or page tables on
+//    exit runs out of memory long before the last round. The parent
+//    retries when fork returns -1, which it does when the process table
+//    is full or no page is left for the child's page tables.
+
+#define FORKSTRESS_ROUNDS 5000
+
+extern uint8_t end[];
+
+// These global variables go on the data page.
+unsigned nforks;
+unsigned nfailures;
+
+void process_main(void) {
+    uint8_t* heap_top = ROUNDUP((uint8_t*) end, PAGESIZE);
+
+    while (nforks < FORKSTRESS_ROUNDS) {
+        pid_t p = sys_fork();
+        if (p == 0) {
+            nforks = sys_getpid();
+            if (sys_page_alloc(heap_top) == 0) {
+                *heap_top = nforks;
+            }
+            sys_exit();
+        } else if (p < 0) {
+            ++nfailures;
+            sys_yield();
+        } else {
+            ++nforks;
+            if (nforks % 100 == 0) {
+                console_printf(CPOS(22, 0), 0x0E00,
+                               "forkstress: %u forks, %u retries\n",
+                               nforks, nfailures);
+            }
+        }
+    }
+
+    console_printf(CPOS(22, 0), 0x0E00,
+                   "forkstress: done, %u forks, %u retries\n",
+                   nforks, nfailures);
+    while (1) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,82 @@
+#include "process.h"
+#include "lib.h"
+
+// p-latency.c
+//
+//    Reports the kernel's own latency statistics (sys_getstats) for
+//    sys_getpid, sys_yield, sys_page_alloc, and sys_fork: after running
+//    each call a number of times, prints the minimum, mean, and 99th
+//    percentile cycles from kernel entry to return to user mode. Mean and
+//    percentile cover only this run's calls; the percentile is the upper
+//    bound of its histogram bucket.
+//
+//    Run it with command "latency", or 'l' at the console.
+
+#define LATENCY_CALLS 2000
+#define LATENCY_PAGES 256
+#define LATENCY_FORKS 256
+
+extern uint8_t end[];
+
+// These global variables go on the data page.
+exception_stats before;
+exception_stats after;
+
+static void report(int row, const char* name, int intno) {
+    sys_getstats(intno, &after);
+    uint64_t n = after.count - before.count;
+    uint64_t rank = n - n / 100;
+    uint64_t seen = after.hist[0] - before.hist[0];
+    int b = 0;
+    while (b < STATS_NBUCKETS - 1 && seen < rank) {
+        ++b;
+        seen += after.hist[b] - before.hist[b];
+    }
+    console_printf(CPOS(row, 0), 0x0E00,
+                   "latency: %-10s %4lu calls, min %lu, mean %lu, p99 < %lu\n",
+                   name, n, after.min_cycles,
+                   n ? (after.cycles - before.cycles) / n : 0,
+                   stats_bucket_min(b + 1));
+}
+
+void process_main(void) {
+    sys_getstats(INT_SYS_GETPID, &before);
+    for (int i = 0; i < LATENCY_CALLS; ++i) {
+        (void) sys_getpid();
+    }
+    report(20, "getpid", INT_SYS_GETPID);
+
+    sys_getstats(INT_SYS_YIELD, &before);
+    for (int i = 0; i < LATENCY_CALLS; ++i) {
+        sys_yield();
+    }
+    report(21, "yield", INT_SYS_YIELD);
+
+    uint8_t* heap_top = ROUNDUP((uint8_t*) end, PAGESIZE);
+    sys_getstats(INT_SYS_PAGE_ALLOC, &before);
+    for (int i = 0; i < LATENCY_PAGES; ++i, heap_top += PAGESIZE) {
+        if (sys_page_alloc(heap_top) < 0) {
+            break;
+        }
+        *heap_top = i;
+    }
+    report(22, "page_alloc", INT_SYS_PAGE_ALLOC);
+
+    // Children exit at once; the parent yields so they can.
+    sys_getstats(INT_SYS_FORK, &before);
+    for (int i = 0; i < LATENCY_FORKS; ) {
+        pid_t p = sys_fork();
+        if (p == 0) {
+            sys_exit();
+        } else if (p > 0) {
+            ++i;
+        }
+        sys_yield();
+    }
+    report(23, "fork", INT_SYS_FORK);
+
+    // Do nothing forever
+    while (1) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,106 @@
+#include "process.h"
+#include "lib.h"
+
+// p-pagebench.c
+//
+//    Measures how fast the kernel hands out physical pages. Allocates heap
+//    pages until it runs out of address space or physical memory, timing
+//    every sys_page_alloc() and the first write to the page with the
+//    cycle counter (so a LAZY_ALLOC kernel's fault is counted too), and
+//    prints pages/sec overall and for the first and last PAGEBENCH_WINDOW
+//    pages, so allocation cost that grows with memory in use shows up.
+//    Batches of PAGEBENCH_BATCH single-page calls alternate with single
+//    sys_page_alloc_range() calls for as many pages, and the two methods'
+//    throughput is printed too.
+//
+//    Run it with command "pagebench", or 'b' at the console.
+
+#define PAGEBENCH_WINDOW 32
+#define PAGEBENCH_BATCH 16
+#define PAGEBENCH_MAXPAGES 768      // MEMSIZE_VIRTUAL / PAGESIZE
+
+extern uint8_t end[];
+
+static uint32_t page_cycles[PAGEBENCH_MAXPAGES];
+
+
+static uint64_t pages_per_sec(uint64_t hz, uint64_t cycles, unsigned npages) {
+    return cycles ? hz * npages / cycles : 0;
+}
+
+void process_main(void) {
+    pid_t p = sys_getpid();
+    uint64_t hz = cycle_counter_rate();
+
+    uint8_t* heap_top = ROUNDUP((uint8_t*) end, PAGESIZE);
+    uint8_t* stack_bottom = ROUNDDOWN((uint8_t*) read_rsp() - 1, PAGESIZE);
+
+    unsigned npages = 0;
+    uint64_t total = 0;
+    uint64_t method_cycles[2] = { 0, 0 };   // [1]: sys_page_alloc_range
+    unsigned method_pages[2] = { 0, 0 };
+    int range = 0;
+    while (heap_top != stack_bottom) {
+        unsigned want = (stack_bottom - heap_top) / PAGESIZE;
+        want = want < PAGEBENCH_BATCH ? want : PAGEBENCH_BATCH;
+        unsigned got = 0;
+        if (range) {
+            uint64_t t0 = read_cycle_counter();
+            int r = sys_page_alloc_range(heap_top, want, 0);
+            got = r > 0 ? r : 0;
+            for (unsigned i = 0; i < got; ++i) {
+                heap_top[i * PAGESIZE] = p;
+            }
+            uint64_t t1 = read_cycle_counter();
+            for (unsigned i = 0; i < got; ++i) {
+                page_cycles[npages + i] = (t1 - t0) / got;
+            }
+            method_cycles[1] += t1 - t0;
+            total += t1 - t0;
+        } else {
+            for (; got < want; ++got) {
+                uint64_t t0 = read_cycle_counter();
+                if (sys_page_alloc(heap_top + got * PAGESIZE) < 0) {
+                    break;
+                }
+                heap_top[got * PAGESIZE] = p;   /* check write access */
+                uint64_t t1 = read_cycle_counter();
+                page_cycles[npages + got] = t1 - t0;
+                method_cycles[0] += t1 - t0;
+                total += t1 - t0;
+            }
+        }
+        method_pages[range] += got;
+        npages += got;
+        heap_top += got * PAGESIZE;
+        if (got < want) {
+            break;
+        }
+        range = !range;
+    }
+
+    unsigned window = npages < PAGEBENCH_WINDOW ? npages : PAGEBENCH_WINDOW;
+    uint64_t head = 0, tail = 0;
+    for (unsigned i = 0; i < window; ++i) {
+        head += page_cycles[i];
+        tail += page_cycles[npages - window + i];
+    }
+
+    console_printf(CPOS(22, 0), 0x0E00,
+                   "pagebench: %u pages, %lu cycles/page, %lu pages/sec\n",
+                   npages, npages ? total / npages : 0,
+                   pages_per_sec(hz, total, npages));
+    console_printf(CPOS(23, 0), 0x0E00,
+                   "pagebench: first %u %lu pages/sec, last %u %lu pages/sec\n",
+                   window, pages_per_sec(hz, head, window),
+                   window, pages_per_sec(hz, tail, window));
+    console_printf(CPOS(21, 0), 0x0E00,
+                   "pagebench: single %lu pages/sec, range %lu pages/sec\n",
+                   pages_per_sec(hz, method_cycles[0], method_pages[0]),
+                   pages_per_sec(hz, method_cycles[1], method_pages[1]));
+
+    // Do nothing forever
+    while (1) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,57 @@
+#include "process.h"
+#include "lib.h"
+
+// p-pingpong.c
+//
+//    Measures inter-process round-trip latency through shared memory. The
+//    process maps a one-page shared memory region, forks, and then parent
+//    and child pass a turn word back and forth PINGPONG_ROUNDS times,
+//    sleeping in sys_futex_wait until it is their turn and waking the
+//    other side with sys_futex_wake. No data is copied through the kernel.
+//
+//    Run it with command "pingpong", or 'p' at the console.
+
+#define PINGPONG_ROUNDS 2000
+
+extern uint8_t end[];
+
+void process_main(void) {
+    uint64_t hz = cycle_counter_rate();
+
+    volatile int* turn = (volatile int*) ROUNDUP((uint8_t*) end, PAGESIZE);
+    int id = sys_shm_create(1);
+    assert(id >= 0);
+    int r = sys_shm_map(id, (void*) turn);
+    assert(r == 0);
+    *turn = 0;
+
+    pid_t child = sys_fork();
+    assert(child >= 0);
+    int me = child == 0;        // parent plays on 0, child on 1
+
+    uint64_t t0 = read_cycle_counter();
+    for (int i = 0; i < PINGPONG_ROUNDS; ++i) {
+        while (*turn != me) {
+            sys_futex_wait((int*) turn, !me);
+        }
+        *turn = !me;
+        sys_futex_wake((int*) turn, 1);
+    }
+    if (child == 0) {
+        sys_exit();
+    }
+    while (*turn != me) {
+        sys_futex_wait((int*) turn, !me);
+    }
+    uint64_t cycles = read_cycle_counter() - t0;
+
+    console_printf(CPOS(23, 0), 0x0E00,
+                   "pingpong: %u round trips, %lu cycles each, %lu/sec\n",
+                   PINGPONG_ROUNDS, cycles / PINGPONG_ROUNDS,
+                   cycles ? hz * PINGPONG_ROUNDS / cycles : 0);
+
+    // Do nothing forever
+    while (1) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,42 @@
+#include "process.h"
+#include "lib.h"
+
+// p-syscallbench.c
+//
+//    Measures system call throughput: times SYSCALLBENCH_CALLS calls each
+//    of sys_getpid() (trap and return) and sys_yield() (trap, scheduler,
+//    and return, as this process runs alone). Compare a kernel built with
+//    FAST_EXCEPTIONS=1 against the default build.
+//
+//    Run it with command "syscallbench", or 'y' at the console.
+
+#define SYSCALLBENCH_CALLS 20000
+
+static void report(int row, const char* name, uint64_t hz, uint64_t cycles) {
+    console_printf(CPOS(row, 0), 0x0E00,
+                   "syscallbench: %s %lu cycles/call, %lu calls/sec\n",
+                   name, cycles / SYSCALLBENCH_CALLS,
+                   cycles ? hz * SYSCALLBENCH_CALLS / cycles : 0);
+}
+
+void process_main(void) {
+    uint64_t hz = cycle_counter_rate();
+
+    uint64_t t0 = read_cycle_counter();
+    for (int i = 0; i < SYSCALLBENCH_CALLS; ++i) {
+        (void) sys_getpid();
+    }
+    uint64_t t1 = read_cycle_counter();
+    for (int i = 0; i < SYSCALLBENCH_CALLS; ++i) {
+        sys_yield();
+    }
+    uint64_t t2 = read_cycle_counter();
+
+    report(22, "getpid", hz, t1 - t0);
+    report(23, "yield ", hz, t2 - t1);
+
+    // Do nothing forever
+    while (1) {
+        sys_sleep(100);
+    }
+}
@@ -23,6 +23,25 @@ void app_printf(int colorid, const char* format, ...) {
 }
 
 
+// cycle_counter_rate
+//    Count cycles over CALIBRATE_TICKS timer ticks, starting on a tick
+//    boundary.
+
+#define TIMER_HZ 100            // must match HZ in kernel.c
+#define CALIBRATE_TICKS 10
+
+uint64_t cycle_counter_rate(void) {
+    unsigned t = ticks;
+    while (ticks == t) {
+    }
+    uint64_t start = read_cycle_counter();
+    t = ticks;
+    while (ticks - t < CALIBRATE_TICKS) {
+    }
+    return (read_cycle_counter() - start) * TIMER_HZ / CALIBRATE_TICKS;
+}
+
+
 // panic, assert_fail
 //     Call the INT_SYS_PANIC system call so the kernel loops until Control-C.
 
@@ -32,6 +32,28 @@ static inline void sys_yield(void) {
                   : "cc", "memory");
 }
 
+// sys_sleep(nticks)
+//    Block for at least `nticks` timer ticks (there are 100 ticks a second),
+//    leaving the CPU to other processes. sys_sleep(0) is sys_yield().
+static inline void sys_sleep(unsigned nticks) {
+    asm volatile ("int %0" : /* no result */
+                  : "i" (INT_SYS_SLEEP), "D" /* %rdi */ (nticks)
+                  : "cc", "memory");
+}
+
+// sys_getstats(intno, stats)
+//    Copy the kernel's statistics for interrupt number `intno` (a system
+//    call number, INT_PAGEFAULT, or the timer interrupt) into `*stats`.
+//    Returns 0 on success and -1 if `intno` is not tracked or `stats` is
+//    not writable.
+static inline int sys_getstats(int intno, exception_stats* stats) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_GETSTATS), "D" (intno), "S" (stats)
+                  : "cc", "memory");
+    return result;
+}
+
 // sys_page_alloc(addr)
 //    Allocate a page of memory at address `addr`. `Addr` must be page-aligned
 //    (i.e., a multiple of PAGESIZE == 4096). Returns 0 on success and -1
@@ -44,6 +66,74 @@ static inline int sys_page_alloc(void* addr) {
     return result;
 }
 
+// sys_page_alloc_range(addr, npages, flags)
+//    Allocate `npages` pages of memory starting at page-aligned address
+//    `addr` in one system call. Returns the number of pages allocated,
+//    from `addr` up; fewer than `npages` means memory ran out. With flag
+//    PAGE_ALLOC_ALL, allocates either all the pages or none (returns 0).
+//    Returns -1 if `addr` is unaligned, the range is not in the process's
+//    address space or already has a page mapped, or `flags` is invalid.
+static inline int sys_page_alloc_range(void* addr, size_t npages,
+                                       int flags) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_PAGE_ALLOC_RANGE), "D" (addr),
+                    "S" (npages), "d" (flags)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_shm_create(npages)
+//    Create a shared memory region of `npages` zeroed pages (at most 16).
+//    Returns its ID, which any process may pass to sys_shm_map, or -1 if
+//    out of regions or memory. The region lives until no process that
+//    created or mapped it, or forked from one that did, is left.
+static inline int sys_shm_create(size_t npages) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_SHM_CREATE), "D" (npages)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_shm_map(id, addr)
+//    Map shared memory region `id` writable at page-aligned address
+//    `addr`, where nothing is mapped yet. A process maps a region at most
+//    once; children forked afterwards share the mapping. Returns 0 on
+//    success and -1 on failure.
+static inline int sys_shm_map(int id, void* addr) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_SHM_MAP), "D" (id), "S" (addr)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_futex_wait(addr, val)
+//    If the int at `addr` still equals `val`, block until another process
+//    calls sys_futex_wake on the same word (through any mapping of it) and
+//    return 0. Otherwise return -1 at once. `addr` must be in a shared
+//    memory region (see sys_shm_map); -1 is returned for any other address.
+static inline int sys_futex_wait(int* addr, int val) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_FUTEX_WAIT), "D" (addr), "S" (val)
+                  : "cc", "memory");
+    return result;
+}
+
+// sys_futex_wake(addr, n)
+//    Wake up to `n` processes waiting on the int at `addr`, in the order
+//    they started waiting. Returns the number woken, or -1 if `addr` is
+//    not in a shared memory region.
+static inline int sys_futex_wake(int* addr, int n) {
+    int result;
+    asm volatile ("int %1" : "=a" (result)
+                  : "i" (INT_SYS_FUTEX_WAKE), "D" (addr), "S" (n)
+                  : "cc", "memory");
+    return result;
+}
+
 // sys_fork()
 //    Fork the current process. On success, return the child's process ID to
 //    the parent, and return 0 to the child. On failure, return -1.
@@ -83,4 +173,9 @@ static inline pid_t __attribute__((noreturn)) sys_panic(const char* msg) {
 //    into that variable. The initial color is based on the current process ID.
 void app_printf(int colorid, const char* format, ...);
 
+// cycle_counter_rate()
+//    Returns the rate of read_cycle_counter() in cycles/sec, measured
+//    against the kernel's timer `ticks`. Takes about 0.1 sec.
+uint64_t cycle_counter_rate(void);
+
 #endif
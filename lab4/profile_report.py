@@ -0,0 +1,110 @@
+"""Symbolize the timer-sampled profile of a PROFILE=1 WeensyOS run.
+
+Run e.g. `make PROFILE=1 run`, quit with 'q' (the kernel logs its samples
+on poweroff), then `python3 profile_report.py`. Prints a flat profile per
+binary: samples, percent of all samples, and function (with --lines,
+function and source line).
+"""
+from collections import defaultdict
+import argparse
+import bisect
+import os.path
+import subprocess
+import sys
+
+parser = argparse.ArgumentParser(description='Symbolize a WeensyOS profile')
+parser.add_argument(
+    '--log', type=str, default='/tmp/log.txt',
+    help='QEMU log with PROFILE lines'
+)
+parser.add_argument(
+    '--objdir', type=str, default='obj', help='Directory with the ELF files'
+)
+parser.add_argument(
+    '--lines', action='store_true', help='Attribute samples to source lines'
+)
+parser.add_argument(
+    '--top', type=int, default=20, help='Rows to print per binary'
+)
+args = parser.parse_args()
+
+# Program numbers, in the order of ramimages[] in k-loader.c.
+PROGRAMS = [
+    'p-allocator', 'p-allocator2', 'p-allocator3', 'p-allocator4',
+    'p-fork', 'p-forkexit', 'p-pagebench', 'p-forkstress', 'p-syscallbench',
+    'p-latency', 'p-pingpong',
+]
+
+
+def binary_for(program):
+    name = 'kernel' if program < 0 else PROGRAMS[program]
+    return os.path.join(args.objdir, name + '.full')
+
+
+def read_symbols(elf):
+    """Return sorted function start addresses and names from `elf`."""
+    out = subprocess.run(['nm', '-n', elf], capture_output=True, text=True,
+                         check=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[1] in 'tTwW':
+            addrs.append(int(fields[0], 16))
+            names.append(fields[2])
+    return addrs, names
+
+
+def symbolize(elf, rips):
+    """Map each rip to a function name, or to file:line with --lines."""
+    if args.lines:
+        out = subprocess.run(['addr2line', '-f', '-e', elf]
+                             + ['%x' % rip for rip in rips],
+                             capture_output=True, text=True,
+                             check=True).stdout.splitlines()
+        return {rip: '%s %s' % (out[2 * i], os.path.basename(out[2 * i + 1]))
+                for i, rip in enumerate(rips)}
+    addrs, names = read_symbols(elf)
+    result = {}
+    for rip in rips:
+        i = bisect.bisect_right(addrs, rip) - 1
+        result[rip] = names[i] if i >= 0 else '0x%x' % rip
+    return result
+
+
+def main():
+    samples = defaultdict(lambda: defaultdict(int))   # program -> rip -> n
+    pids = defaultdict(set)
+    summary = None
+    with open(args.log) as f:
+        for line in f:
+            fields = line.split()
+            if fields and fields[0] == 'PROFILE' and len(fields) == 6:
+                _, _, pid, program, rip, count = fields
+                samples[int(program)][int(rip, 16)] += int(count)
+                pids[int(program)].add(int(pid))
+            elif fields and fields[0] == 'PROFILE_SUMMARY':
+                summary = line.strip()
+    if not samples:
+        sys.exit('%s: no PROFILE lines (build with PROFILE=1 and quit '
+                 'with q)' % args.log)
+
+    total = sum(sum(rips.values()) for rips in samples.values())
+    for program in sorted(samples):
+        rips = samples[program]
+        elf = binary_for(program)
+        symbols = symbolize(elf, sorted(rips))
+        counts = defaultdict(int)
+        for rip, n in rips.items():
+            counts[symbols[rip]] += n
+        mode = 'kernel (idle)' if program < 0 else 'user'
+        print('%s, %s, pids %s: %d samples' % (
+            elf, mode, ' '.join(map(str, sorted(pids[program]))),
+            sum(rips.values())))
+        ranked = sorted(counts.items(), key=lambda kv: -kv[1])
+        for name, n in ranked[:args.top]:
+            print('  %8d %6.2f%%  %s' % (n, 100.0 * n / total, name))
+    if summary:
+        print(summary)
+
+
+main()
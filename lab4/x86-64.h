@@ -47,10 +47,15 @@ static inline int pageindex(uintptr_t addr, int level) {
 #define PTE_P   ((x86_64_pageentry_t) 1)    // entry is Present
 #define PTE_W   ((x86_64_pageentry_t) 2)    // entry is Writeable
 #define PTE_U   ((x86_64_pageentry_t) 4)    // entry is User-accessible
+// - Caching flags: for memory-mapped device registers
+#define PTE_PWT ((x86_64_pageentry_t) 8)    // entry is Write-Through
+#define PTE_PCD ((x86_64_pageentry_t) 16)   // entry is Cache-Disabled
 // - Accessed flags: automatically turned on by processor
 #define PTE_A   ((x86_64_pageentry_t) 32)   // entry was Accessed (read/written)
 #define PTE_D   ((x86_64_pageentry_t) 64)   // entry was Dirtied (written)
 #define PTE_PS  ((x86_64_pageentry_t) 128)  // entry has a large Page Size
+// - Available flags: ignored by the processor, free for the kernel's use
+#define PTE_AVAIL ((x86_64_pageentry_t) 0xE00)
 // - There are other flags too!
 
 // Page fault error flags
@@ -158,6 +163,7 @@ DECLARE_X86_FUNCTION(void       cpuid(uint32_t info, uint32_t* eaxp,
                                       uint32_t* ebxp, uint32_t* ecxp,
                                       uint32_t* edxp));
 DECLARE_X86_FUNCTION(uint64_t   read_cycle_counter(void));
+DECLARE_X86_FUNCTION(uint64_t   rdmsr(uint32_t msr));
 
 // %cr0 flag bits (useful for lcr0() and rcr0())
 #define CR0_PE                  0x00000001      // Protection Enable
@@ -383,9 +389,15 @@ static inline void cpuid(uint32_t info, uint32_t* eaxp, uint32_t* ebxp,
 }
 
 static inline uint64_t read_cycle_counter(void) {
-    uint64_t tsc;
-    asm volatile("rdtsc" : "=A" (tsc));
-    return tsc;
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+    return ((uint64_t) hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile("rdmsr" : "=a" (lo), "=d" (hi) : "c" (msr));
+    return ((uint64_t) hi << 32) | lo;
 }
 
 static inline uint32_t fetch_and_addl(uint32_t* object, uint32_t addend) {